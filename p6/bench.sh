@@ -0,0 +1,181 @@
+#!/bin/bash
+#
+# Benchmark matrix of p6 (make bench): runs the client against a forked
+# kv_store program for every combination of client threads, server threads,
+# window size, table size, skew and put ratio, a few times each after
+# warm-up runs, with both sides pinned to cores (-A/-C). Each run goes to
+# the CSV file, and a summary of the median throughput of each point is
+# printed at the end. Then the microbenchmarks time the rings alone
+# (ring_bench) and the table engines alone (table_bench) over the same
+# thread counts and tables, so a regression can be pinned on one of them.
+
+clients="1 4"
+servers="1 4"
+windows="1 32"
+sizes="1000 1000000"
+skews="0 1.2"
+ratios="0.1 0.5"
+requests=200000
+runs=3
+warmup=1
+engine=chain
+extra=""
+out=bench.csv
+micro_out=bench_micro
+micro=1
+
+usage() {
+	echo "Usage: $0 [-h] [-n client_threads] [-t server_threads] [-w windows] [-s table_sizes] [-z skews] [-r put_ratios] [-N num_reqs] [-R runs] [-W warmup] [-E engine] [-x client_args] [-o csv_file] [-O micro_csv_prefix] [-M]"
+	echo "Lists are space separated, e.g. -n \"1 2 4 8\""
+	echo "-n client threads (default: $clients)"
+	echo "-t kv_store threads (default: $servers)"
+	echo "-w window sizes (default: $windows)"
+	echo "-s initial table sizes (default: $sizes)"
+	echo "-z skews, see gen_workload -s (default: $skews)"
+	echo "-r put ratios (default: $ratios)"
+	echo "-N requests per run (default: $requests)"
+	echo "-R timed runs per point (default: $runs)"
+	echo "-W warm-up runs per point, not recorded (default: $warmup)"
+	echo "-E table engine (default: $engine)"
+	echo "-x more options for every client run, e.g. \"-S -m 16\""
+	echo "-o CSV file of the client runs (default: $out)"
+	echo "-O the microbenchmarks go to prefix_ring.csv and prefix_table.csv (default: $micro_out)"
+	echo "-M if set, skips the microbenchmarks"
+}
+
+while getopts "hn:t:w:s:z:r:N:R:W:E:x:o:O:M" op; do
+	case $op in
+	n) clients=$OPTARG ;;
+	t) servers=$OPTARG ;;
+	w) windows=$OPTARG ;;
+	s) sizes=$OPTARG ;;
+	z) skews=$OPTARG ;;
+	r) ratios=$OPTARG ;;
+	N) requests=$OPTARG ;;
+	R) runs=$OPTARG ;;
+	W) warmup=$OPTARG ;;
+	E) engine=$OPTARG ;;
+	x) extra=$OPTARG ;;
+	o) out=$OPTARG ;;
+	O) micro_out=$OPTARG ;;
+	M) micro=0 ;;
+	h) usage; exit 0 ;;
+	*) usage; exit 1 ;;
+	esac
+done
+
+for prog in client server gen_workload; do
+	if [ ! -x ./$prog ]; then
+		echo "ERROR: ./$prog is missing, run make first." >&2
+		exit 1
+	fi
+done
+
+workloads=$(mktemp -d)
+trap 'rm -rf "$workloads"' EXIT
+
+# One workload per skew and put ratio, the same for every run
+for z in $skews; do
+	for r in $ratios; do
+		./gen_workload -n "$requests" -s "$z" -r "$r" -S 1 \
+			-i "$workloads/w_${z}_$r.bin" -e "$workloads/s_${z}_$r.bin" > /dev/null || exit 1
+	done
+done
+
+# Throughput (K/s), then GET p50/p99 and PUT p99 (us) of one client run, or
+# nothing if it failed
+run_client() {
+	./client -f -A -C -E "$engine" -n "$1" -t "$2" -w "$3" -s "$4" \
+		-i "$workloads/w_${5}_$6.bin" -e "$workloads/s_${5}_$6.bin" $extra 2> /dev/null |
+	awk '/^Throughput:/ { tput = $2 }
+	     /^GET / { gp50 = $3; gp99 = $5 }
+	     /^PUT / { pp99 = $5 }
+	     END { if (tput != "") printf "%s,%s,%s,%s\n", tput, gp50, gp99, pp99 }'
+}
+
+echo "client_threads,server_threads,window,table_size,skew,put_ratio,run,kreq_s,get_p50_us,get_p99_us,put_p99_us" > "$out"
+points=0
+for c in $clients; do
+for t in $servers; do
+for w in $windows; do
+for s in $sizes; do
+for z in $skews; do
+for r in $ratios; do
+	points=$((points + 1))
+	for i in $(seq 1 "$warmup"); do
+		run_client "$c" "$t" "$w" "$s" "$z" "$r" > /dev/null
+	done
+	for i in $(seq 1 "$runs"); do
+		res=$(run_client "$c" "$t" "$w" "$s" "$z" "$r")
+		if [ -z "$res" ]; then
+			echo "WARNING: run $i of -n $c -t $t -w $w -s $s, skew $z, put ratio $r failed" >&2
+			continue
+		fi
+		echo "$c,$t,$w,$s,$z,$r,$i,$res" >> "$out"
+	done
+	echo -ne "\r$points points done" >&2
+done; done; done; done; done; done
+echo >&2
+
+# Median, min and max throughput of each point
+echo
+echo "Client runs ($out), throughput in K requests/s:"
+awk -F, 'NR > 1 {
+		key = $1 "," $2 "," $3 "," $4 "," $5 "," $6
+		if (!(key in n))
+			order[++points] = key
+		v[key, ++n[key]] = $8
+		p99[key] = p99[key] " " $10
+	}
+	END {
+		printf "%7s %7s %6s %9s %5s %5s | %9s %9s %9s %4s\n", "clients", "servers", "window", "size", "skew", "puts", "median", "min", "max", "runs"
+		for (p = 1; p <= points; p++) {
+			key = order[p]
+			m = n[key]
+			# Insertion sort of the runs of the point
+			for (i = 2; i <= m; i++)
+				for (j = i; j > 1 && v[key, j - 1] > v[key, j]; j--) {
+					x = v[key, j]; v[key, j] = v[key, j - 1]; v[key, j - 1] = x
+				}
+			med = m % 2 ? v[key, (m + 1) / 2] : (v[key, m / 2] + v[key, m / 2 + 1]) / 2
+			split(key, f, ",")
+			printf "%7s %7s %6s %9s %5s %5s | %9.1f %9.1f %9.1f %4d\n", f[1], f[2], f[3], f[4], f[5], f[6], med, v[key, 1], v[key, m], m
+		}
+	}' "$out"
+
+[ "$micro" = 1 ] || exit 0
+for prog in ring_bench table_bench; do
+	if [ ! -x ./$prog ]; then
+		echo "ERROR: ./$prog is missing, run make $prog first." >&2
+		exit 1
+	fi
+done
+
+# Ring alone: client threads produce, server threads consume
+ring_out=${micro_out}_ring.csv
+echo "bench,layout,producers,consumers,batch,median,min,max" > "$ring_out"
+for c in $clients; do
+	for t in $servers; do
+		./ring_bench -A -q -p "$c" -c "$t" -n "$requests" -r "$runs" >> "$ring_out"
+	done
+done
+# Table alone: server threads on the engine, with every table and key mix
+# (its warnings, e.g. of a bucket table too small for the keys, still show)
+table_out=${micro_out}_table.csv
+echo "bench,engine,threads,table_size,keys,skew,put_ratio,median,min,max" > "$table_out"
+for t in $servers; do
+	for s in $sizes; do
+		for z in $skews; do
+			for r in $ratios; do
+				./table_bench -A -q -E "$engine" -n "$t" -s "$s" -z "$z" -r "$r" -o "$requests" -R "$runs" >> "$table_out"
+			done
+		done
+	done
+done
+
+echo
+echo "Rings alone ($ring_out), in M items per second:"
+awk -F, 'NR > 1 { printf "%-9s producers %3s consumers %3s batch %3s | %8.2f (%.2f - %.2f)\n", $2, $3, $4, $5, $6, $7, $8 }' "$ring_out"
+echo
+echo "Table alone ($table_out), in M operations per second:"
+awk -F, 'NR > 1 { printf "%-9s threads %3s size %9s keys %7s skew %4s puts %4s | %8.2f (%.2f - %.2f)\n", $2, $3, $4, $5, $6, $7, $8, $9, $10 }' "$table_out"
@@ -0,0 +1,56 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Timing and pinning helpers shared by the client, the server and the
+ * microbenchmarks. Users have to define _GNU_SOURCE before any include.
+*/
+
+/* Return the elapsed time between two timespecs in ns */
+static inline double get_elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Pin the calling thread to the tid-th CPU (wrapping around) of the ones the
+ * process may run on - counting from the last one if from_last, so a client
+ * and a server pinned from the first one stay apart
+*/
+static inline void pin_thread(int tid, bool from_last) {
+	cpu_set_t allowed, mine;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	int target = tid % CPU_COUNT(&allowed);
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		int cpu = from_last ? CPU_SETSIZE - 1 - i : i;
+		if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+			CPU_ZERO(&mine);
+			CPU_SET(cpu, &mine);
+			pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+			return;
+		}
+	}
+}
+
+static inline int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Call run(arg) once to warm up, then repeat times, and sort what the timed
+ * runs returned into results - results[0] is the min, results[repeat - 1]
+ * the max
+ * @return the median
+*/
+static inline double bench_repeat(double (*run)(void *arg), void *arg, int repeat, double *results) {
+	run(arg);
+	for (int r = 0; r < repeat; r++)
+		results[r] = run(arg);
+	qsort(results, repeat, sizeof(double), cmp_double);
+	return repeat % 2 ? results[repeat / 2] : (results[repeat / 2 - 1] + results[repeat / 2]) / 2;
+}
@@ -0,0 +1,184 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "bucket_table.h"
+#include "stats.h"
+#include "wait.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define SLOT_MASK ((1u << BUCKET_SLOTS) - 1)
+
+/**
+ * Compare k against every key of the bucket at once.
+ * @return a bitmask with bit i set if slot i holds k.
+*/
+static inline uint32_t bucket_match(const struct kv_bucket *b, key_type k) {
+#if defined(__AVX2__)
+    __m256i keys = _mm256_load_si256((const __m256i*) b->keys);
+    __m256i eq = _mm256_cmpeq_epi32(keys, _mm256_set1_epi32(k));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq)) & SLOT_MASK;
+#elif defined(__SSE2__)
+    __m128i needle = _mm_set1_epi32(k);
+    __m128i lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*) b->keys), needle);
+    __m128i hi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*) (b->keys + 4)), needle);
+    uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                    (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+    return mask & SLOT_MASK; // Lane 7 is the version
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < BUCKET_SLOTS; i++)
+        mask |= (uint32_t) (b->keys[i] == k) << i;
+    return mask;
+#endif
+}
+
+/* Spin until we own the bucket (version goes from even to odd) - the
+ * holder could have been preempted, so yield every now and then */
+static void bucket_lock(struct kv_bucket *b) {
+    for (int spins = 1; ; spins++) {
+        uint32_t ver = __atomic_load_n(&b->version, __ATOMIC_RELAXED);
+        if (!(ver & 1) && __atomic_compare_exchange_n(&b->version, &ver, ver + 1, true,
+                                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        if (spins == 1)
+            STAT_INC(lock_contended);
+        if (spins % 64 == 0)
+            sched_yield();
+        else
+            cpu_relax();
+    }
+}
+
+static void bucket_unlock(struct kv_bucket *b) {
+    __atomic_store_n(&b->version, b->version + 1, __ATOMIC_RELEASE);
+}
+
+int init_bucket_table(struct bucket_table *t, int capacity) {
+    uint32_t n = table_size_for((int) (capacity / (BUCKET_SLOTS * BUCKET_MAX_LOAD)) + 1);
+    t->num_buckets = n;
+    t->zero_val = 0;
+    t->exclusive = false;
+    t->map = NULL;
+    t->map_len = 0;
+    t->buckets = aligned_alloc(64, sizeof(struct kv_bucket) * n);
+    if (t->buckets == NULL)
+        return -1;
+    memset(t->buckets, 0, sizeof(struct kv_bucket) * n);
+    return 0;
+}
+
+void free_bucket_table(struct bucket_table *t) {
+    if (t->map != NULL)
+        munmap(t->map, t->map_len);
+    else
+        free(t->buckets);
+    t->map = NULL;
+    t->buckets = NULL;
+    t->num_buckets = 0;
+}
+
+int bucket_update(struct bucket_table *t, key_type k, enum kv_op op, value_type v, value_type cmp,
+                  value_type *old) {
+    if (k == 0) {
+        value_type prev = __atomic_load_n(&t->zero_val, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&t->zero_val, &prev, kv_apply(op, prev, v, cmp), true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+        if (old != NULL)
+            *old = prev;
+        return 0;
+    }
+    uint32_t index = hash_function(k, t->num_buckets);
+    for (uint32_t probes = 0; probes < t->num_buckets; probes++) {
+        struct kv_bucket *b = &t->buckets[index];
+        if (!t->exclusive)
+            bucket_lock(b);
+        uint32_t match = bucket_match(b, k);
+        value_type cur = match ? b->vals[__builtin_ctz(match)] : 0;
+        if (old != NULL)
+            *old = cur;
+        if (!match && bucket_match(b, 0) && !kv_inserts(op, v, cmp)) {
+            // Not here, and it wouldn't be put
+            if (!t->exclusive)
+                bucket_unlock(b);
+            STAT_INC(probe_len[stats_len_bucket(probes + 1)]);
+            return 0;
+        }
+        if (!match)
+            match = bucket_match(b, 0); // First empty slot
+        if (match) {
+            int slot = __builtin_ctz(match);
+            b->vals[slot] = kv_apply(op, cur, v, cmp);
+            b->keys[slot] = k;
+            if (!t->exclusive)
+                bucket_unlock(b);
+            STAT_INC(probe_len[stats_len_bucket(probes + 1)]);
+            return 0;
+        }
+        if (!t->exclusive)
+            bucket_unlock(b);
+        index = index + 1 == t->num_buckets ? 0 : index + 1;
+    }
+    return -1;
+}
+
+void bucket_copy(struct bucket_table *t, uint32_t i, struct kv_bucket *dst) {
+    struct kv_bucket *b = &t->buckets[i];
+    uint32_t ver;
+    do {
+        ver = __atomic_load_n(&b->version, __ATOMIC_ACQUIRE);
+        if (ver & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(dst, b, sizeof(struct kv_bucket));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((ver & 1) || __atomic_load_n(&b->version, __ATOMIC_RELAXED) != ver);
+    dst->version = 0;
+}
+
+void bucket_prefetch(struct bucket_table *t, key_type k) {
+    __builtin_prefetch(&t->buckets[hash_function(k, t->num_buckets)]);
+}
+
+value_type bucket_get(struct bucket_table *t, key_type k) {
+    if (k == 0)
+        return __atomic_load_n(&t->zero_val, __ATOMIC_RELAXED);
+    uint32_t index = hash_function(k, t->num_buckets);
+    for (uint32_t probes = 0; probes < t->num_buckets; probes++) {
+        struct kv_bucket *b = &t->buckets[index];
+        uint32_t ver, match, empty;
+        value_type v;
+        if (t->exclusive) { // Nobody can be writing
+            match = bucket_match(b, k);
+            if (match || bucket_match(b, 0)) {
+                STAT_INC(probe_len[stats_len_bucket(probes + 1)]);
+                return match ? b->vals[__builtin_ctz(match)] : 0;
+            }
+            index = index + 1 == t->num_buckets ? 0 : index + 1;
+            continue;
+        }
+        do {
+            ver = __atomic_load_n(&b->version, __ATOMIC_ACQUIRE);
+            if (ver & 1) {
+                sched_yield();
+                continue;
+            }
+            match = bucket_match(b, k);
+            empty = bucket_match(b, 0);
+            v = match ? b->vals[__builtin_ctz(match)] : 0;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((ver & 1) || __atomic_load_n(&b->version, __ATOMIC_RELAXED) != ver);
+        if (match || empty) { // If it's not here, the key would have been put in the empty slot
+            STAT_INC(probe_len[stats_len_bucket(probes + 1)]);
+            return v;
+        }
+        index = index + 1 == t->num_buckets ? 0 : index + 1;
+    }
+    return 0;
+}
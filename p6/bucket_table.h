@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "common.h"
+
+/* Key-value pairs per bucket - 7 keys plus the version fill one 32-byte
+ * half of the cache line and the 7 values the other */
+#define BUCKET_SLOTS 7
+
+/* Highest fraction of the slots we size the table for, so linear probing
+ * stays short */
+#define BUCKET_MAX_LOAD 0.85
+
+/**
+ * A cache-line sized bucket of an open addressing table. Keys and values are
+ * stored inline, and a slot is empty while its key is 0.
+*/
+struct __attribute__((aligned(64))) kv_bucket {
+    key_type keys[BUCKET_SLOTS];
+    uint32_t version; // Seqlock - odd while a writer holds the bucket
+    value_type vals[BUCKET_SLOTS];
+    uint32_t pad;
+};
+
+/**
+ * A hashtable that uses linear probing over cache-line sized buckets. Slots
+ * are never emptied again, so a key is always stored before the first empty
+ * slot of its probe sequence. Readers take no locks - they re-read a bucket
+ * if its version changed while they were looking at it.
+*/
+struct bucket_table {
+    uint32_t num_buckets;
+    struct kv_bucket *buckets;
+    value_type zero_val; // Key 0 marks empty slots, so its value lives here
+    bool exclusive; // Only one thread ever uses the table - skip the seqlocks
+    void *map; // Mapping the buckets live in (a snapshot), NULL if malloc'd
+    size_t map_len;
+};
+
+/**
+ * Initialize a bucket table.
+ * @param capacity the number of keys the table has to hold - it can't grow.
+ * @return 0 on success, -1 if the allocation failed.
+*/
+int init_bucket_table(struct bucket_table *t, int capacity);
+
+/**
+ * Free the buckets of a bucket table.
+*/
+void free_bucket_table(struct bucket_table *t);
+
+/**
+ * Apply op to the value of k atomically (under the bucket's lock), putting k
+ * if it isn't present (see kv_inserts()).
+ * @param old if not NULL, set to the value found (0 if there was none).
+ * @return 0 on success, -1 if the table is full.
+*/
+int bucket_update(struct bucket_table *t, key_type k, enum kv_op op, value_type v, value_type cmp,
+                  value_type *old);
+
+/**
+ * Put the key-value pair into the table, or replace the value if the key is
+ * already present.
+ * @param old if not NULL, set to the value replaced (0 if there was none).
+ * @return 0 on success, -1 if the table is full.
+*/
+static inline int bucket_put(struct bucket_table *t, key_type k, value_type v, value_type *old) {
+    return bucket_update(t, k, KV_SET, v, 0, old);
+}
+
+/**
+ * Get the value with the given key from the table.
+ * @return the corresponding value, 0 if the key is not present.
+*/
+value_type bucket_get(struct bucket_table *t, key_type k);
+
+/**
+ * Copy bucket i out of the table, consistently (it is re-read while a
+ * writer holds it).
+*/
+void bucket_copy(struct bucket_table *t, uint32_t i, struct kv_bucket *dst);
+
+/**
+ * Start loading the bucket k hashes to into the cache.
+*/
+void bucket_prefetch(struct bucket_table *t, key_type k);
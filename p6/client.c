@@ -1,33 +1,51 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <signal.h>
 #include <string.h>
+#include <math.h>
 
+#include "bench_util.h"
 #include "common.h"
 #include "ring_buffer.h"
+#include "hist.h"
+#include "stats.h"
+#include "value_heap.h"
+#include "client_table.h"
+#include "workload.h"
 
 #define MAX_THREADS 128
 #define LINE_LEN 256
+#define ATTACH_TRIES 500 /* 10 ms apart - how long -a waits for the server's region */
+#define FORK_CLIENTS 64 /* Client slots of a server forked with -a */
 
 #define PUT_STR "put"
 #define GET_STR "get"
+#define SCAN_STR "scan"
+#define ADD_STR "add"
+#define CAS_STR "cas"
+#define SWAP_STR "swap"
 #define DEL_STR "del"
 
-#define READY 1
-#define NOT_READY 0
+#define READY COMP_READY
+#define NOT_READY COMP_NOT_READY
 
-struct request {
-	key_type k;
-	value_type v;
-	enum REQUEST_TYPE t;
-};
+/* Latency histograms are indexed by request type (PUT, GET, SCAN or one of
+ * the read-modify-writes) */
+#define NUM_LAT (SWAP + 1)
+const enum REQUEST_TYPE lat_types[] = {PUT, GET, SCAN, ADD, CAS, SWAP};
+const char *lat_names[NUM_LAT] = {[PUT] = "PUT", [GET] = "GET", [SCAN] = "SCAN",
+				  [ADD] = "ADD", [CAS] = "CAS", [SWAP] = "SWAP"};
+#define NUM_LAT_TYPES (sizeof(lat_types) / sizeof(lat_types[0]))
 
 struct thread_context {
 	int tid; /* thread ID */
@@ -35,14 +53,31 @@ struct thread_context {
 	struct request *reqs; /* requests assigned to this thread */
 	struct buffer_descriptor *res; /* Corresponding result for each request in reqs */
 	struct buffer_descriptor *comps; /* Pointer to the start of the status board for this thread */
+	struct buffer_descriptor *subs; /* Staging area for batched submissions (win_size entries) */
+	struct ring *ring; /* Ring this thread submits to - its own shard in the sharded layout */
+	int *sub_part; /* Partitioned layout: partition of each staged submission */
+	struct buffer_descriptor *part_subs; /* Partitioned layout: one partition's share of subs */
 	int win_size;
+	int inflight; /* # of window slots with a request in flight */
+	int nxt_sub; /* next window slot to submit to (in-order mode) */
 	int nxt_comp; /* next completion that we're expecting */
+	int *slot_req; /* Out-of-order mode: request index in flight in each window slot, -1 if free */
+	int *free_slots; /* Out-of-order mode: stack of free window slots */
+	int num_free;
 	int comp_off; /* byte offset of the status board for this thread, w.r.t the start of the shared memory area */
+	struct kv_pair *args; /* MGET/MPUT/SCAN arrays for this thread, slot_pairs pairs per window slot */
+	uint64_t *sub_ns; /* When the request in each window slot was submitted (open loop: meant to be) */
+	uint64_t *sched; /* Open loop: when each request is meant to be sent, in ns after start_ns */
+	uint64_t start_ns;
+	struct hist *lat; /* Latency histograms of this thread, indexed by PUT/GET/SCAN */
+	uint64_t *slot_epoch; /* -V: epoch announced for the blobs the request in each window slot returns, 0 if none */
+	int args_off; /* byte offset of args, w.r.t the start of the shared memory area */
 };
 
 struct ring *ring = NULL;
 char *shmem_area = NULL;
 char shm_file[] = "shmem_file";
+char heap_file[] = "heap_file";
 char workload_file[256];
 char expected_file[256];
 char server_exec[256];
@@ -57,24 +92,76 @@ int verbose = 0;
 int child_pid = -1;
 int do_fork = 0;
 int validate = 0;
+enum ring_mode ring_mode = RING_LOCKFREE;
+int sharded = 0;
+int partitioned = 0;
+int pin_server = 0;
+int pin_clients = 0; /* pin our threads to cores, from the last one down */
+int hot_server = 0; /* have the server cache hot keys per thread */
+int out_of_order = 0;
+int multi_size = 1; /* max requests merged into one MGET/MPUT */
+int slot_pairs = 0; /* pairs in the MGET/MPUT/SCAN array of each window slot, 0 if there are none */
+int args_base = 0; /* byte offset of the first thread's MGET/MPUT/SCAN arrays */
+char hist_file[256] = ""; /* where to dump the latency histograms, nowhere if empty */
+/* -V: values are blobs of value_min to value_max bytes in the value heap */
+uint32_t value_min = 0, value_max = 0;
+uint64_t heap_mb = 256;
+struct value_heap *heap = NULL;
+/* Open loop: offered load in K requests/s (over all threads), swept from
+ * rate_start to rate_end in rate_step increments - closed loop if 0 */
+double rate_start = 0, rate_end = 0, rate_step = 0;
+int poisson = 1; /* Open loop: Poisson arrivals, or evenly spaced ones */
+int comp_base = 0; /* byte offset of the first status board */
+int attach = 0; /* attach to a slot of a region the server owns, instead of laying one out */
+int client_slot = -1; /* -a: the slot we claimed */
+int shm_fd = -1; /* -a: the region's file, holding our slot's lock */
 
 /* Server arguments */
 int s_num_threads = 1;
 int s_init_table_size = 1000;
+char s_engine[16] = "chain";
+char s_wait[16] = "adaptive";
+char s_wal[256] = ""; /* write-ahead log file, none if empty */
+char s_wal_sync[16] = "always";
+char s_snapshot[256] = ""; /* snapshot file, none if empty */
+int s_snapshot_period = 0;
+char s_mem_cap[32] = ""; /* memory cap of the table in MiB, none if empty */
 
 /* prints "Client" before each line of output because the child will also be printing
  * to the same terminal */
 #define PRINTV(...) if (verbose) printf("Client: "); if (verbose) printf(__VA_ARGS__)
 
 /*
- * Fork the server program as a child process
+ * -a: bytes of a slot's area we lay our completion boards and MGET/MPUT/SCAN
+ * arrays out in
+*/
+uint64_t attach_area_size() {
+	return (uint64_t) num_threads * win_size *
+		(sizeof(struct buffer_descriptor) + slot_pairs * sizeof(struct kv_pair));
+}
+
+/*
+ * Stop the forked server, if there is one: SIGTERM lets it print its
+ * statistics and exit, and we wait for it so it doesn't outlive us
+*/
+void stop_server() {
+	if (child_pid <= 0)
+		return;
+	kill(child_pid, SIGTERM);
+	waitpid(child_pid, NULL, 0);
+	child_pid = -1;
+}
+
+/*
+ * Fork the server program as a child process - it is stopped when we
+ * exit, however we exit
 */
 void fork_server() {
 	pid_t pid = fork();
 	
 	if (pid == 0) { /* The child process */
 		/* number of arguments including the NULL pointer at the end */
-		const int NUM_ARGS = 7;
+		const int NUM_ARGS = 26;
 		const int MAX_ARG_LEN = 256;
 		char **argv = malloc(NUM_ARGS * sizeof(char *));
 		if (argv == NULL)
@@ -92,31 +179,104 @@ void fork_server() {
 		sprintf(argv[idx++], "%d", s_init_table_size);
 		sprintf(argv[idx++], "-n");
 		sprintf(argv[idx++], "%d", s_num_threads);
+		sprintf(argv[idx++], "-e");
+		strcpy(argv[idx++], s_engine);
+		sprintf(argv[idx++], "-w");
+		strcpy(argv[idx++], s_wait);
 		if (verbose)
 			sprintf(argv[idx++], "-v");
+		if (pin_server)
+			sprintf(argv[idx++], "-a");
+		if (hot_server)
+			sprintf(argv[idx++], "-k");
+		if (attach) {
+			sprintf(argv[idx++], "-M");
+			uint64_t kib = (attach_area_size() + 1023) >> 10;
+			sprintf(argv[idx++], "%d:%lu", FORK_CLIENTS, kib > CLIENT_AREA_KIB ? kib : CLIENT_AREA_KIB);
+		}
+		if (s_wal[0] != '\0') {
+			sprintf(argv[idx++], "-l");
+			strcpy(argv[idx++], s_wal);
+			sprintf(argv[idx++], "-y");
+			strcpy(argv[idx++], s_wal_sync);
+		}
+		if (s_snapshot[0] != '\0') {
+			sprintf(argv[idx++], "-r");
+			strcpy(argv[idx++], s_snapshot);
+			sprintf(argv[idx++], "-p");
+			sprintf(argv[idx++], "%d", s_snapshot_period);
+		}
+		if (s_mem_cap[0] != '\0') {
+			sprintf(argv[idx++], "-m");
+			strcpy(argv[idx++], s_mem_cap);
+		}
 		argv[idx++] = NULL;
 		execvp(server_exec, argv);
 
 		/* Will only reach here if there's an error with execvp */
 		perror("execvp");
+		_exit(EXIT_FAILURE);
 	}
 	else if (pid > 0) { /* The parent process if there was no error */
 		child_pid = pid;
+		atexit(stop_server);
 	} else { /* The parent process in case of an error with fork */
 		perror("fork");
 	}
 }
 
+/*
+ * Create the value heap (-V) in its own shared memory segment, and tell the
+ * server about it through the ring
+*/
+void init_heap() {
+	uint64_t size = heap_mb << 20;
+	int fd = open(heap_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0)
+		perror("open");
+
+	/* Drop what an earlier run left - the blobs are only touched as
+	 * they're handed out, so this doesn't cost the whole size up front */
+	if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)
+		perror("ftruncate");
+
+	heap = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+	if (heap == (void *)-1) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	heap_init(heap, size, num_threads);
+	ring->heap_size = size;
+}
+
 /*
  * Initialize the shared memory ring buffer
  * Sets the shmem_area global variable to the beginning of the shared region
  * Sets the ring global variable the beginning of the shared region 
  * Shared memory area is organized as follows:
  * | RING | TID_0_COMPLETIONS | TID_1_COMPLETIONS | ... | TID_N_COMPLETIONS |
+ * With -S, each thread also gets its own submission ring (shard):
+ * | RING | TID_0_SHARD | ... | TID_N_SHARD | TID_0_COMPLETIONS | ... |
+ * With -P, there is a ring per server thread (partition) instead:
+ * | RING | PART_0 | ... | PART_M | TID_0_COMPLETIONS | ... |
+ * With -m, or scans in the workload, the completions are followed by the
+ * key/value arrays of each thread's MGET/MPUT/SCAN requests (slot_pairs
+ * pairs per window slot):
+ * | ... | TID_N_COMPLETIONS | TID_0_ARGS | ... | TID_N_ARGS |
+ * The region ends with the server's live statistics (one cache line
+ * aligned struct thread_stats per server thread, see stats.h):
+ * | ... | STATS |
 */
 int init_client() {
-	int shm_size = sizeof(struct ring) + 
+	int num_rings = sharded ? num_threads : partitioned ? s_num_threads : 0;
+	comp_base = sizeof(struct ring) * (1 + num_rings);
+	args_base = comp_base +
 		num_threads * win_size * sizeof(struct buffer_descriptor);
+	int stats_base = args_base +
+		num_threads * win_size * slot_pairs * sizeof(struct kv_pair);
+	stats_base = (stats_base + 63) & ~63;
+	int shm_size = stats_base + stats_page_size(s_num_threads);
 	
 	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	if (fd < 0)
@@ -137,13 +297,114 @@ int init_client() {
 	ring = (struct ring *)mem;
 	shmem_area = mem;
 	int ring_rc = -1;
-	if (ring_rc = init_ring(ring) < 0) {
+	if ((ring_rc = init_ring_mode(ring, ring_mode)) < 0) {
 		printf("Ring initialization failed with %d as return code\n", ring_rc);
 		exit(EXIT_FAILURE);
 	}
+	if (sharded && (ring_rc = init_shards(ring, num_threads)) < 0) {
+		printf("Shard initialization failed with %d as return code\n", ring_rc);
+		exit(EXIT_FAILURE);
+	}
+	if (partitioned && (ring_rc = init_partitions(ring, s_num_threads)) < 0) {
+		printf("Partition initialization failed with %d as return code\n", ring_rc);
+		exit(EXIT_FAILURE);
+	}
+	if (value_min > 0)
+		init_heap();
+	struct stats_page *stats = (struct stats_page *) (mem + stats_base);
+	stats->magic = STATS_MAGIC;
+	stats->num_threads = s_num_threads;
+	ring->stats_off = stats_base;
+	ring->stats_threads = s_num_threads;
 
 	if (do_fork)
 		fork_server();
+	return 0;
+}
+
+/*
+ * Map the region of a server that owns it (-a), if there is one and it's
+ * ready: its client table is set up and a live server holds its lock
+ * @return 0 on success, -1 if not (yet)
+*/
+static int map_served_region() {
+	int fd = open(shm_file, O_RDWR);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct ring)) {
+		close(fd);
+		return -1;
+	}
+	char *mem = mmap(NULL, st.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == (void *)-1) {
+		close(fd);
+		return -1;
+	}
+	struct ring *r = (struct ring *) mem;
+	struct client_table *t = client_table(r);
+	if (r->clients_off == 0 || r->clients_off + sizeof(struct client_table) > (uint64_t) st.st_size ||
+	    __atomic_load_n(&t->magic, __ATOMIC_ACQUIRE) != CLIENT_TABLE_MAGIC ||
+	    client_area_off(t, t->max_clients) > (uint64_t) st.st_size || !client_table_served(r, fd)) {
+		munmap(mem, st.st_size);
+		close(fd);
+		return -1;
+	}
+	ring = r;
+	shmem_area = mem;
+	shm_fd = fd;
+	return 0;
+}
+
+/*
+ * Attach to the region of a server that owns it (-a, -M on the server):
+ * claim a client slot, submit to its ring, and lay the status boards and
+ * MGET/MPUT/SCAN arrays out in its area the way init_client() lays them
+ * out in a region of our own:
+ * | SLOT_AREA: TID_0_COMPLETIONS | ... | TID_N_COMPLETIONS | TID_0_ARGS | ... | TID_N_ARGS |
+ * With -f, the server we fork creates the region, so we wait for it.
+*/
+void attach_client() {
+	if (do_fork) {
+		/* Don't mistake the region of an earlier run for the new one */
+		unlink(shm_file);
+		fork_server();
+	}
+	struct timespec nap = {0, 10000000};
+	for (int tries = 0; map_served_region() != 0; tries++) {
+		if (tries == ATTACH_TRIES) {
+			printf("No server is serving clients in %s (run it with -M)\n", shm_file);
+			exit(EXIT_FAILURE);
+		}
+		nanosleep(&nap, NULL);
+	}
+
+	struct client_table *t = client_table(ring);
+	client_slot = client_attach(ring, shm_fd);
+	if (client_slot < 0) {
+		printf("All %u client slots of the server are taken\n", t->max_clients);
+		exit(EXIT_FAILURE);
+	}
+	uint64_t need = attach_area_size();
+	if (need > t->area_size) {
+		printf("This client needs %lu KiB of the server's slot area, which has %lu (see -M on the server)\n",
+		       (need + 1023) >> 10, t->area_size >> 10);
+		client_detach(ring, shm_fd, client_slot);
+		exit(EXIT_FAILURE);
+	}
+	comp_base = client_area_off(t, client_slot);
+	args_base = comp_base + num_threads * win_size * sizeof(struct buffer_descriptor);
+	memset(shmem_area + comp_base, 0, need);
+	PRINTV("Attached to client slot %d\n", client_slot);
+}
+
+/*
+ * -a: give our slot back - every request we sent has completed by now
+*/
+void detach_client() {
+	if (client_slot >= 0)
+		client_detach(ring, shm_fd, client_slot);
+	client_slot = -1;
 }
 
 /*
@@ -157,6 +418,14 @@ int get_req_type(char *req_str, enum REQUEST_TYPE *type) {
 		*type = PUT;
 	else if (!strcmp(req_str, GET_STR))
 		*type = GET;
+	else if (!strcmp(req_str, SCAN_STR))
+		*type = SCAN;
+	else if (!strcmp(req_str, ADD_STR))
+		*type = ADD;
+	else if (!strcmp(req_str, CAS_STR))
+		*type = CAS;
+	else if (!strcmp(req_str, SWAP_STR))
+		*type = SWAP;
 	else
 		rc = -1;
 
@@ -168,8 +437,7 @@ int get_req_type(char *req_str, enum REQUEST_TYPE *type) {
  * @return 0 on success, -1 on failure
 */
 int add_line_to_req(char *line, int index) {
-	char *copy_line = strdup(line);
-	char *tok = strtok(copy_line, " ");
+	char *tok = strtok(line, " ");
 	if (tok == NULL)
 		return -1;
 
@@ -186,8 +454,18 @@ int add_line_to_req(char *line, int index) {
 	int key = atoi(tok);
 	requests[index].k = key;
 
+	/* A CAS has the value it expects before the one it puts */
+	requests[index].cmp = 0;
+	if (type == CAS) {
+		tok = strtok(NULL, " ");
+		if (tok == NULL)
+			return -1;
+		requests[index].cmp = strtoul(tok, NULL, 10);
+	}
+
+	/* The value of a PUT (or ADD, CAS, SWAP), the number of pairs of a SCAN */
 	int value;
-	if (type == PUT) {
+	if (type != GET) {
 		tok = strtok(NULL, " ");
 		if (tok == NULL)
 			return -1;
@@ -212,11 +490,60 @@ int count_lines(FILE *f) {
 	return nl;
 }
 
+/*
+ * Map a file in one of the binary formats of workload.h
+ * @param magic the magic the file has to start with
+ * @param size the size of an element
+ * @param count set to the number of elements in the file
+ * @return the elements (right after the header), NULL if name isn't a
+ * binary file of that kind - one too short for its count is an error
+*/
+void *map_binary(const char *name, const char *magic, size_t size, uint64_t *count) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct workload_header hdr;
+	struct stat statbuf;
+	char *mem = NULL;
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && !memcmp(hdr.magic, magic, sizeof(hdr.magic)) &&
+	    fstat(fd, &statbuf) == 0) {
+		/* A truncated file (or a garbage count) would have us read past the mapping */
+		if (hdr.count > (statbuf.st_size - sizeof(hdr)) / size) {
+			fprintf(stderr, "ERROR: %s holds fewer than the %lu elements its header says\n", name, hdr.count);
+			exit(EXIT_FAILURE);
+		}
+		mem = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mem == (void *)-1) {
+			perror("mmap");
+			mem = NULL;
+		}
+	}
+	/* mmap dups the fd, no longer needed */
+	close(fd);
+	if (mem == NULL)
+		return NULL;
+	*count = hdr.count;
+	return mem + sizeof(hdr);
+}
+
 /*
  * Reads the workload_file and stores in the requests array (global var)
- * Allocates both requests/results array enough space for all requests
+ * A binary workload is mapped as is, a text one is parsed
+ * Allocates the results array enough space for all requests
 */
 void read_input_files() {
+	uint64_t count;
+	requests = map_binary(workload_file, WORKLOAD_MAGIC, sizeof(struct request), &count);
+	if (requests != NULL) {
+		num_requests = count;
+		PRINTV("Mapped %d requests\n", num_requests);
+		results = malloc(num_requests * sizeof(struct buffer_descriptor));
+		if (results == NULL)
+			perror("malloc");
+		return;
+	}
+
 	FILE *f = fopen(workload_file, "r");
 	if (f == NULL)
 		perror("fopen");
@@ -248,31 +575,252 @@ void read_input_files() {
 }
 
 /*
- * Submits as many requests as win_size allows 
+ * Size the MGET/MPUT/SCAN array of each window slot (slot_pairs) for -m and
+ * the longest scan in the workload
+ * @return 0 on success, -1 if the workload has a request we can't send
+*/
+int size_args() {
+	slot_pairs = multi_size > 1 ? multi_size : 0;
+	for (int i = 0; i < num_requests; i++) {
+		if (value_min > 0 && requests[i].t >= ADD) {
+			printf("Read-modify-writes can't be sent with -V, whose values are handles\n");
+			return -1;
+		}
+		if (requests[i].t != SCAN)
+			continue;
+		if (partitioned) {
+			printf("Scans can't be sent to a partitioned kv_store program (-P)\n");
+			return -1;
+		}
+		if (requests[i].v > MULTI_MAX) {
+			printf("Scan %d asks for %u pairs, the most is %d\n", i, requests[i].v, MULTI_MAX);
+			return -1;
+		}
+		if ((int) requests[i].v > slot_pairs)
+			slot_pairs = requests[i].v;
+	}
+	return 0;
+}
+
+/* Length of the blob of value v, between value_min and value_max */
+static inline uint32_t blob_len(value_type v) {
+	return value_min + (value_max > value_min ? hash_murmur(v) % (value_max - value_min + 1) : 0);
+}
+
+/*
+ * Store v as a blob: v itself, then a pattern of bytes made from it
+ * @return the handle to PUT
+*/
+static uint32_t put_blob(value_type v) {
+	uint32_t len = blob_len(v);
+	uint32_t handle = heap_alloc(heap, len);
+	if (handle == 0) {
+		printf("The value heap is full, use a larger -B\n");
+		exit(EXIT_FAILURE);
+	}
+	struct blob *b = heap_blob(heap, handle);
+	memcpy(b->data, &v, sizeof(v));
+	for (uint32_t i = sizeof(v); i < len; i++)
+		b->data[i] = (char) (v + i);
+	return handle;
+}
+
+/*
+ * Read the value of a blob a request returned, in place
+ * With -c, the whole blob is checked, so a blob freed or reused while we
+ * could still read it shows up
+ * @return the value, 0 if handle is 0 (no such key) or the blob is corrupt
+*/
+static value_type read_blob(uint32_t handle) {
+	if (handle == 0)
+		return 0;
+	struct blob *b = heap_blob(heap, handle);
+	value_type v;
+	memcpy(&v, b->data, sizeof(v));
+	if (!validate)
+		return v;
+	bool ok = b->len == blob_len(v);
+	for (uint32_t i = sizeof(v); ok && i < b->len; i++)
+		ok = b->data[i] == (char) (v + i);
+	if (!ok) {
+		fprintf(stderr, "The blob at handle %u is corrupt\n", handle);
+		return 0;
+	}
+	return v;
+}
+
+/*
+ * -V: announce the oldest epoch the requests in flight were sent at, now
+ * that we're done with the blobs of those that completed
+*/
+static void release_blobs(struct thread_context *ctx) {
+	uint64_t min = 0;
+	for (int slot = 0; slot < ctx->win_size; slot++)
+		if (ctx->slot_epoch[slot] != 0 && (min == 0 || ctx->slot_epoch[slot] < min))
+			min = ctx->slot_epoch[slot];
+	heap_announce(heap, ctx->tid, min);
+}
+
+/* Current time in ns, for latencies */
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Submit the n staged requests of a thread to their partitions' rings, one
+ * batch per partition
+ * @param ctx Context for this thread
+ * @param n number of requests in ctx->subs
+*/
+static void submit_partitioned(struct thread_context *ctx, int n) {
+	for (int i = 0; i < n; i++) {
+		int part = ctx->sub_part[i];
+		if (part < 0)
+			continue; /* Went out with an earlier partition */
+		int m = 0;
+		for (int j = i; j < n; j++) {
+			if (ctx->sub_part[j] == part) {
+				ctx->part_subs[m++] = ctx->subs[j];
+				ctx->sub_part[j] = -1;
+			}
+		}
+		ring_submit_batch(ring_partition(ring, part), ctx->part_subs, m);
+	}
+}
+
+/*
+ * Submits as many requests as win_size allows, up to request limit
+ * With win_size > 1, the whole refill goes to the ring as a single batch
+ * With -m, runs of up to multi_size GETs (PUTs) go out as a single MGET
+ * (MPUT) that takes one window slot
+ * With -P, each request goes to the ring of the partition that owns its key
  * last_submitted is updated in this function
  * @param ctx Context for this thread
- * @param last_completed last request that was completed
  * @param last_submitted last request that was submitted
+ * @param limit first request not to submit yet (open loop: not due yet)
 */
-void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_submitted) {
-	struct buffer_descriptor bd;
+void submit_reqs(struct thread_context *ctx, int *last_submitted, int limit) {
 	struct request *reqs = ctx->reqs;
+	int n = 0;
+	int slots[win_size]; /* window slot of each staged request */
+	int firsts[win_size]; /* first request of each staged request */
 	/* Keep win_size number of in-flight requests */
-	for (int i = *last_submitted; *last_submitted - *last_completed < win_size; i++) {
+	while (ctx->inflight < win_size) {
 		/* Have we submitted all of the requests? */
-		if (*last_submitted >= ctx->num_reqs)
+		if (*last_submitted >= limit)
 			break;
 
-		memset(&bd, 0, sizeof(struct buffer_descriptor));
-		bd.k = reqs[i].k;
-		bd.v = reqs[i].v;
-		bd.req_type = reqs[i].t;
-		bd.res_off = ctx->comp_off + (*last_submitted % win_size) * sizeof(struct buffer_descriptor);
-		ring_submit(ring, &bd);
-		(*last_submitted)++;
+		/* In order, requests go round the window; out of order, they
+		 * take whichever slot has been freed */
+		int i = *last_submitted;
+		int slot = ctx->nxt_sub;
+		if (out_of_order) {
+			slot = ctx->free_slots[--ctx->num_free];
+			ctx->slot_req[slot] = i;
+		}
+		else
+			ctx->nxt_sub = (ctx->nxt_sub + 1) % win_size;
+
+		int cnt = 1;
+		int part = partitioned ? key_partition(reqs[i].k, s_num_threads) : 0;
+		while (cnt < multi_size && (reqs[i].t == GET || reqs[i].t == PUT) && i + cnt < limit && reqs[i + cnt].t == reqs[i].t &&
+		       (!partitioned || key_partition(reqs[i + cnt].k, s_num_threads) == part))
+			cnt++;
+
+		if (partitioned)
+			ctx->sub_part[n] = part;
+		slots[n] = slot;
+		firsts[n] = i;
+		struct buffer_descriptor *bd = &ctx->subs[n++];
+		memset(bd, 0, sizeof(struct buffer_descriptor));
+		bd->k = reqs[i].k;
+		bd->v = reqs[i].v;
+		bd->cmp = reqs[i].cmp;
+		bd->req_type = reqs[i].t;
+		bd->res_off = ctx->comp_off + slot * sizeof(struct buffer_descriptor);
+		if (bd->req_type == SCAN)
+			bd->arg_off = ctx->args_off + slot * slot_pairs * sizeof(struct kv_pair);
+		if (heap != NULL && reqs[i].t == PUT && cnt == 1)
+			bd->v = put_blob(reqs[i].v);
+		/* Announced before the request goes out, so whatever blob it
+		 * returns can't be freed until we release it */
+		if (heap != NULL && reqs[i].t != PUT)
+			ctx->slot_epoch[slot] = heap_enter(heap, ctx->tid);
+		if (cnt > 1) {
+			struct kv_pair *pairs = ctx->args + slot * slot_pairs;
+			for (int j = 0; j < cnt; j++) {
+				pairs[j].k = reqs[i + j].k;
+				pairs[j].v = heap != NULL && reqs[i].t == PUT ? put_blob(reqs[i + j].v) : reqs[i + j].v;
+			}
+			bd->req_type = reqs[i].t == GET ? MGET : MPUT;
+			bd->k = cnt;
+			bd->v = 0;
+			bd->arg_off = ctx->args_off + slot * slot_pairs * sizeof(struct kv_pair);
+		}
+		*last_submitted += cnt;
+		ctx->inflight++;
+
+		PRINTV("New submission %u %u\n", bd->k, bd->v);
+	}
+
+	/* Latencies are counted from here - the ring is part of them. Open
+	 * loop, they're counted from when the request was meant to be sent,
+	 * so time it spent waiting for the window counts too. */
+	uint64_t now = now_ns();
+	for (int i = 0; i < n; i++)
+		ctx->sub_ns[slots[i]] = ctx->sched != NULL ? ctx->start_ns + ctx->sched[firsts[i]] : now;
+
+	if (partitioned)
+		submit_partitioned(ctx, n);
+	else if (n == 1)
+		ring_submit(ctx->ring, ctx->subs);
+	else if (n > 1)
+		ring_submit_batch(ctx->ring, ctx->subs, n);
+}
 
-		PRINTV("New submission %u %u\n", bd.k, bd.v);
+/*
+ * Copy the completion in a window slot to the results of the request(s) it
+ * carried, starting at req, and record their latency
+ * A SCAN's result holds the scan_digest() of the pairs it returned
+ * @param now when we saw the completion
+ * @return the number of requests the slot carried
+*/
+static int collect_slot(struct thread_context *ctx, int slot, int req, uint64_t now) {
+	struct buffer_descriptor *comp = &ctx->comps[slot];
+	uint64_t lat = now - ctx->sub_ns[slot];
+	struct kv_pair *pairs = ctx->args + slot * slot_pairs;
+	if (comp->req_type == FAILED) {
+		fprintf(stderr, "ERROR: the server refused request %d of thread %d\n", req, ctx->tid);
+		exit(EXIT_FAILURE);
+	}
+	if (heap != NULL) {
+		ctx->slot_epoch[slot] = 0;
+		if (comp->req_type == GET)
+			comp->v = read_blob(comp->v);
+		else if (comp->req_type == MGET)
+			for (uint32_t j = 0; j < comp->k; j++)
+				pairs[j].v = read_blob(pairs[j].v);
+		else if (comp->req_type == SCAN)
+			for (uint32_t j = 0; j < comp->v; j++)
+				pairs[j].v = read_blob(pairs[j].v);
 	}
+	if (comp->req_type != MGET && comp->req_type != MPUT) {
+		memcpy(&ctx->res[req], comp, sizeof(struct buffer_descriptor));
+		if (comp->req_type == SCAN)
+			ctx->res[req].v = scan_digest(pairs, comp->v);
+		hist_record(&ctx->lat[comp->req_type], lat);
+		return 1;
+	}
+	for (uint32_t j = 0; j < comp->k; j++) {
+		ctx->res[req + j] = *comp;
+		ctx->res[req + j].req_type = comp->req_type == MGET ? GET : PUT;
+		ctx->res[req + j].k = pairs[j].k;
+		ctx->res[req + j].v = pairs[j].v;
+		hist_record(&ctx->lat[ctx->res[req + j].req_type], lat);
+	}
+	return comp->k;
 }
 
 /*
@@ -280,30 +828,130 @@ void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_subm
  * Updates last_completed if there are any new completions
  * @param ctx context for this thread
  * @param last_completed last request that was completed
- * @param last_submitted last request that was submitted
 */
-void process_completions(struct thread_context *ctx, int *last_completed, int *last_submitted) {
+void process_completions(struct thread_context *ctx, int *last_completed) {
+	uint64_t now = 0; /* read once we see the first completion */
 	/* Check completions until we break */
 	while (true) {
 		/* We're expecting ctx->nxt_comp to be completed. If that's not
 		 * completed, we're done for now. Otherwise, process that and 
 		 * check the next one.
 		 * Notice that we're only allowing 'in-order acknowledgements'. */
-		if (ctx->comps[ctx->nxt_comp].ready == READY) {
+		if (__atomic_load_n(&ctx->comps[ctx->nxt_comp].ready, __ATOMIC_ACQUIRE) == READY) {
 			struct buffer_descriptor tmp = ctx->comps[ctx->nxt_comp];
 			PRINTV("New completion: %u %u\n", tmp.k, tmp.v);
 			ctx->comps[ctx->nxt_comp].ready = NOT_READY;
-			memcpy(&ctx->res[*last_completed], &ctx->comps[ctx->nxt_comp],
-				       	sizeof(struct buffer_descriptor));
+			if (now == 0)
+				now = now_ns();
+			*last_completed += collect_slot(ctx, ctx->nxt_comp, *last_completed, now);
 
 			/* Update for the next iteration */
-			(*last_completed)++;
+			ctx->inflight--;
 			ctx->nxt_comp = (ctx->nxt_comp + 1) % ctx->win_size;
 			PRINTV("LC=%d\n", *last_completed);
 		}
 		else
 			break;
 	}
+	if (heap != NULL && now != 0)
+		release_blobs(ctx);
+}
+
+/*
+ * Out-of-order variant of process_completions: scan every window slot with a
+ * request in flight, and free each one that's done right away so
+ * submit_reqs can refill it - a slow request only holds its own slot
+ * @param ctx context for this thread
+ * @param last_completed number of requests completed so far
+*/
+void process_completions_ooo(struct thread_context *ctx, int *last_completed) {
+	uint64_t now = 0;
+	for (int slot = 0; slot < ctx->win_size; slot++) {
+		int req = ctx->slot_req[slot];
+		if (req < 0 || __atomic_load_n(&ctx->comps[slot].ready, __ATOMIC_ACQUIRE) != READY)
+			continue;
+
+		PRINTV("New completion: %u %u\n", ctx->comps[slot].k, ctx->comps[slot].v);
+		ctx->comps[slot].ready = NOT_READY;
+		if (now == 0)
+			now = now_ns();
+		*last_completed += collect_slot(ctx, slot, req, now);
+		ctx->slot_req[slot] = -1;
+		ctx->free_slots[ctx->num_free++] = slot;
+		ctx->inflight--;
+	}
+	if (heap != NULL && now != 0)
+		release_blobs(ctx);
+}
+
+/* Any slot that has completed, out-of-order mode */
+static bool any_completed(struct thread_context *ctx) {
+	for (int slot = 0; slot < ctx->win_size; slot++)
+		if (ctx->slot_req[slot] >= 0 &&
+		    __atomic_load_n(&ctx->comps[slot].ready, __ATOMIC_ACQUIRE) == READY)
+			return true;
+	return false;
+}
+
+/*
+ * Out-of-order wait_for_completion: any completion will do, so once we're
+ * done spinning we mark every slot in flight COMP_WAITING and sleep on all
+ * of them at once (up to FUTEX_WAIT_ANY_MAX of them) - whichever the server
+ * completes first wakes us
+ * @param ctx context for this thread
+*/
+static void wait_for_any_completion(struct thread_context *ctx) {
+	uint32_t *words[FUTEX_WAIT_ANY_MAX];
+	struct spinner sp = {0};
+	while (!any_completed(ctx)) {
+		if (!spin_or_sleep(&sp))
+			continue;
+		int n = 0;
+		bool done = false;
+		for (int slot = 0; slot < ctx->win_size && n < FUTEX_WAIT_ANY_MAX; slot++) {
+			if (ctx->slot_req[slot] < 0)
+				continue;
+			int *ready = &ctx->comps[slot].ready;
+			int expected = NOT_READY;
+			if (!__atomic_compare_exchange_n(ready, &expected, COMP_WAITING, false,
+							 __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE) &&
+			    expected != COMP_WAITING) {
+				done = true; /* It completed meanwhile */
+				break;
+			}
+			words[n++] = (uint32_t *) ready;
+		}
+		if (!done)
+			futex_wait_any(words, n, COMP_WAITING);
+	}
+	spin_done(&sp);
+}
+
+/*
+ * Wait until the completion we're expecting next (ctx->nxt_comp) is ready,
+ * following the wait strategy - the ready flag doubles as a futex word: we
+ * mark it COMP_WAITING before sleeping on it, and the server wakes us up if
+ * it finds it marked when it completes the request.
+ * Out of order, any completion will do - see wait_for_any_completion()
+ * @param ctx context for this thread
+*/
+void wait_for_completion(struct thread_context *ctx) {
+	if (out_of_order) {
+		wait_for_any_completion(ctx);
+		return;
+	}
+	int *ready = &ctx->comps[ctx->nxt_comp].ready;
+	struct spinner sp = {0};
+	while (__atomic_load_n(ready, __ATOMIC_ACQUIRE) != READY) {
+		if (!spin_or_sleep(&sp))
+			continue;
+		int expected = NOT_READY;
+		if (__atomic_compare_exchange_n(ready, &expected, COMP_WAITING, false,
+						__ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE) ||
+		    expected == COMP_WAITING)
+			futex_wait((uint32_t *) ready, COMP_WAITING);
+	}
+	spin_done(&sp);
 }
 
 /* 
@@ -312,19 +960,120 @@ void process_completions(struct thread_context *ctx, int *last_completed, int *l
 */
 void *thread_function(void *arg) {
 	struct thread_context *ctx = arg;
+	if (pin_clients)
+		pin_thread(ctx->tid, true);
 	int last_completed = 0;
 	int last_submitted = 0;
 	PRINTV("Num reqs is %d\n", ctx->num_reqs);
 	/* Keep submitting the requests and processing the completions */
 	for (; last_submitted < ctx->num_reqs; ) {
-		submit_reqs(ctx, &last_completed, &last_submitted);	
-		process_completions(ctx, &last_completed, &last_submitted);
+		submit_reqs(ctx, &last_submitted, ctx->num_reqs);
+		if (out_of_order)
+			process_completions_ooo(ctx, &last_completed);
+		else
+			process_completions(ctx, &last_completed);
+		/* Nothing to do until the window moves */
+		if (ctx->inflight >= win_size)
+			wait_for_completion(ctx);
 	}
 
 	PRINTV("Done with subs\n");
 	/* There might be some completions still in flight */
-	while (last_completed < ctx->num_reqs)
-		process_completions(ctx, &last_completed, &last_submitted);
+	while (last_completed < ctx->num_reqs) {
+		if (out_of_order)
+			process_completions_ooo(ctx, &last_completed);
+		else
+			process_completions(ctx, &last_completed);
+		if (last_completed < ctx->num_reqs)
+			wait_for_completion(ctx);
+	}
+	return NULL;
+}
+
+/*
+ * Wait until t (in now_ns() time), or until a request in flight completes
+ * if that comes first. With requests in flight we spin on their completions,
+ * so we see (and time) each one as it comes rather than at the next send
+ * time; with none, we sleep while t is far away, and yield the CPU in the
+ * last stretch, so we don't oversleep
+*/
+static void pause_until(struct thread_context *ctx, uint64_t t) {
+	uint64_t now = now_ns();
+	if (now >= t)
+		return;
+	if (ctx->inflight > 0) {
+		while (now_ns() < t) {
+			if (out_of_order ? any_completed(ctx) :
+			    __atomic_load_n(&ctx->comps[ctx->nxt_comp].ready, __ATOMIC_ACQUIRE) == READY)
+				return;
+			cpu_relax();
+		}
+		return;
+	}
+	if (t - now > 100000) {
+		struct timespec nap = {0, t - now - 50000};
+		if (nap.tv_nsec >= 1000000000) {
+			nap.tv_sec = nap.tv_nsec / 1000000000;
+			nap.tv_nsec %= 1000000000;
+		}
+		nanosleep(&nap, NULL);
+	}
+	else
+		sched_yield();
+}
+
+/*
+ * Open-loop version of thread_function: each request is sent at its time in
+ * ctx->sched (or as soon as the window lets us, if we're behind), no matter
+ * how fast the previous ones complete
+ * @param arg context for this thread
+*/
+void *open_loop_thread_function(void *arg) {
+	struct thread_context *ctx = arg;
+	if (pin_clients)
+		pin_thread(ctx->tid, true);
+	int last_completed = 0;
+	int last_submitted = 0;
+	ctx->start_ns = now_ns();
+	while (last_completed < ctx->num_reqs) {
+		uint64_t now = now_ns();
+		int due = last_submitted;
+		while (due < ctx->num_reqs && ctx->start_ns + ctx->sched[due] <= now)
+			due++;
+		submit_reqs(ctx, &last_submitted, due);
+		if (out_of_order)
+			process_completions_ooo(ctx, &last_completed);
+		else
+			process_completions(ctx, &last_completed);
+
+		if (ctx->inflight >= win_size || (last_submitted == ctx->num_reqs && ctx->inflight > 0))
+			wait_for_completion(ctx);
+		else if (last_submitted < ctx->num_reqs)
+			pause_until(ctx, ctx->start_ns + ctx->sched[last_submitted]);
+	}
+	return NULL;
+}
+
+/*
+ * Precompute when each request of a thread is to be sent, for an offered
+ * load of rate K requests/s spread evenly over the threads
+*/
+void make_schedule(struct thread_context *ctx, double rate) {
+	double interval = 1e9 * num_threads / (rate * 1e3); /* mean ns between requests */
+	uint64_t x = 0x9e3779b97f4a7c15ull * (ctx->tid + 1); /* xorshift state */
+	double t = 0;
+	for (int i = 0; i < ctx->num_reqs; i++) {
+		ctx->sched[i] = t;
+		if (poisson) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			double u = ((x >> 11) + 1.0) / (double) (1ull << 53); /* (0, 1] */
+			t += -log(u) * interval;
+		}
+		else
+			t += interval;
+	}
 }
 
 /*
@@ -337,22 +1086,75 @@ void *thread_function(void *arg) {
  *  
  *  Each thread submits an equal contiguous part of the requests
 */
-void start_threads() {
+void start_threads(double rate) {
 	int reqs_per_th = num_requests / num_threads;
 	struct request *r = requests;
 	struct buffer_descriptor *rs = results;
 
 	for (int i = 0; i < num_threads; i++) {
+		/* Open loop, we may run the workload more than once */
+		if (contexts[i].subs != NULL) {
+			contexts[i].inflight = contexts[i].nxt_sub = contexts[i].nxt_comp = 0;
+			for (int t = 0; t < NUM_LAT; t++)
+				hist_init(&contexts[i].lat[t]);
+			make_schedule(&contexts[i], rate);
+			if (pthread_create(&threads[i], NULL, &open_loop_thread_function, &contexts[i]))
+				perror("pthread_create");
+			continue;
+		}
+
 		contexts[i].tid = i;
 		contexts[i].num_reqs = reqs_per_th;
 		contexts[i].reqs = r;
 		contexts[i].win_size = win_size;
-		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + sizeof(struct ring) + i * win_size * sizeof(struct buffer_descriptor));
+		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + comp_base + i * win_size * sizeof(struct buffer_descriptor));
+		contexts[i].ring = sharded ? ring_shard(ring, i) : attach ? ring_shard(ring, client_slot) : ring;
 		contexts[i].res = rs;
+		contexts[i].subs = malloc(win_size * sizeof(struct buffer_descriptor));
+		if (contexts[i].subs == NULL)
+			perror("malloc");
+		contexts[i].sub_ns = malloc(win_size * sizeof(uint64_t));
+		contexts[i].lat = malloc(NUM_LAT * sizeof(struct hist));
+		if (contexts[i].sub_ns == NULL || contexts[i].lat == NULL)
+			perror("malloc");
+		for (int t = 0; t < NUM_LAT; t++)
+			hist_init(&contexts[i].lat[t]);
+		if (partitioned) {
+			contexts[i].sub_part = malloc(win_size * sizeof(int));
+			contexts[i].part_subs = malloc(win_size * sizeof(struct buffer_descriptor));
+			if (contexts[i].sub_part == NULL || contexts[i].part_subs == NULL)
+				perror("malloc");
+		}
+		if (out_of_order) {
+			contexts[i].slot_req = malloc(win_size * sizeof(int));
+			contexts[i].free_slots = malloc(win_size * sizeof(int));
+			if (contexts[i].slot_req == NULL || contexts[i].free_slots == NULL)
+				perror("malloc");
+			/* Pushed in reverse so slots are first handed out in order */
+			for (int j = 0; j < win_size; j++) {
+				contexts[i].slot_req[j] = -1;
+				contexts[i].free_slots[j] = win_size - 1 - j;
+			}
+			contexts[i].num_free = win_size;
+		}
 		/* This is the byte offset to the first window for this thread */
-		contexts[i].comp_off = sizeof(struct ring) + contexts[i].tid * win_size * sizeof(struct buffer_descriptor);
+		contexts[i].comp_off = comp_base + contexts[i].tid * win_size * sizeof(struct buffer_descriptor);
+		contexts[i].args_off = args_base + contexts[i].tid * win_size * slot_pairs * sizeof(struct kv_pair);
+		contexts[i].args = (struct kv_pair *) (shmem_area + contexts[i].args_off);
+
+		contexts[i].slot_epoch = calloc(win_size, sizeof(uint64_t));
+		if (contexts[i].slot_epoch == NULL)
+			perror("calloc");
+
+		contexts[i].sched = NULL;
+		if (rate > 0) {
+			contexts[i].sched = malloc(reqs_per_th * sizeof(uint64_t));
+			if (contexts[i].sched == NULL)
+				perror("malloc");
+			make_schedule(&contexts[i], rate);
+		}
 
-		if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i]))
+		if (pthread_create(&threads[i], NULL, rate > 0 ? &open_loop_thread_function : &thread_function, &contexts[i]))
 			perror("pthread_create");
 
 		/* Each thread is only responsible for an equal part of requests */
@@ -368,7 +1170,7 @@ void wait_for_threads() {
 }
 
 void usage(char *name) {
-	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f]\n", name);
+	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f] [-R ring_mode] [-S] [-E engine] [-W wait] [-o] [-m multi_size] [-P] [-A] [-K] [-L wal_file] [-Y sync] [-Z snapshot_file] [-z secs] [-H hist_file] [-O rate[:end:step]] [-D arrivals] [-V min[:max]] [-B heap_mb] [-a] [-C] [-Q cap_mib]\n", name);
 	printf("-h show this help\n");
 	printf("-n specify the number of threads\n");
 	printf("-w specify the window size (max distance between last submitted request and last completed request\n");
@@ -377,9 +1179,30 @@ void usage(char *name) {
 	printf("-s initial_table_size in the kv_store program (ignored if -f is not set)\n");
 	printf("-f if set, forks the kv_store program as the child process - '-t' and '-s' options are only effective if this is set\n");
 	printf("-c if set, checks the result of get queries - only works if -n 1 and -w 1 (synchronus submission)\n");
-	printf("-l input workload file name (default: workload.txt)\n");
-	printf("-e file name that contains the expected results for get queries(default: solution.txt)\n");
+	printf("-i input workload file name, text or binary (see gen_workload) (default: workload.txt)\n");
+	printf("-e file name that contains the expected results for get queries, text or binary (default: solution.txt)\n");
 	printf("-x full path of the server executable file (default: ./server)\n");
+	printf("-R ring synchronization: 'lockfree' (default) or 'sem' (semaphore + mutex baseline)\n");
+	printf("-E table engine of the kv_store program: 'chain' (default), 'bucket' or 'skiplist' (ignored if -f is not set)\n");
+	printf("-W how threads wait: 'spin', 'adaptive' (spin, then sleep - default) or 'block'; 'client,server' sets the kv_store program's separately\n");
+	printf("-o if set, window slots are reused as soon as their own request completes (out-of-order acknowledgements) instead of strictly in submission order\n");
+	printf("-m merge runs of up to multi_size consecutive gets (puts) of a thread into one MGET (MPUT) request (max %d)\n", MULTI_MAX);
+	printf("-S if set, each thread submits to its own single-producer ring (shard) instead of the shared ring\n");
+	printf("-P if set, the kv_store program is partitioned: each of its threads owns the keys that hash to it, with its own ring and lock-free table\n");
+	printf("-L log the kv_store program's puts to wal_file, and rebuild its table from it at startup (ignored if -f is not set)\n");
+	printf("-Y when the log is synced to disk: 'always' (before each put completes - default), 'never', or every N ms\n");
+	printf("-Z have the kv_store program start from (map) the table image in snapshot_file if there is one, and write it there on SIGUSR1 (ignored if -f is not set)\n");
+	printf("-z also write the snapshot every secs seconds\n");
+	printf("-H dump the GET and PUT latency histograms (ns) to hist_file as CSV\n");
+	printf("-O open loop: send requests at an offered load of rate K requests/s (over all threads) instead of keeping the window full; with end and step, sweep the load from rate to end and print a throughput-latency curve\n");
+	printf("-D open-loop arrivals: 'poisson' (default) or 'fixed' (evenly spaced)\n");
+	printf("-V values are blobs of min (to max) bytes, kept in a shared value heap and passed by handle (default: 4-byte values in the ring)\n");
+	printf("-B size of the value heap in MiB (default: %lu)\n", heap_mb);
+	printf("-a attach to a client slot of a kv_store program that owns the shared memory region (started with -M) instead of setting the region up - any number of client processes can share it; with -f, the forked kv_store program gets %d slots\n", FORK_CLIENTS);
+	printf("-A if set, the kv_store program pins its threads to cores (ignored if -f is not set)\n");
+	printf("-C if set, pins our threads to cores, starting from the last one (the kv_store program's -A starts from the first)\n");
+	printf("-Q cap the memory of the kv_store program's table at cap_mib MiB, evicting keys (CLOCK) past it - needs the chain engine (ignored if -f is not set)\n");
+	printf("-K if set, each kv_store thread keeps the values of the hottest keys it reads in a small private cache (ignored if -f is not set, and with -P)\n");
 }
 
 static int parse_args(int argc, char **argv)
@@ -390,7 +1213,7 @@ static int parse_args(int argc, char **argv)
 	strcpy(server_exec, "./server");
 
 	int op;
-	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:x:")) != -1) {
+	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:x:R:SE:W:om:PAKL:Y:Z:z:H:O:D:V:B:aCQ:")) != -1) {
 		switch (op) {
 		case 'h':
 		usage(argv[0]);
@@ -437,22 +1260,161 @@ static int parse_args(int argc, char **argv)
 		strncpy(server_exec, optarg, 256);
 		break;
 
+		case 'W': {
+		char *server_ws = strchr(optarg, ',');
+		if (server_ws != NULL)
+			*server_ws++ = '\0';
+		else
+			server_ws = optarg;
+		enum wait_strategy ws;
+		if (parse_wait_strategy(optarg, &ws) < 0 || parse_wait_strategy(server_ws, &ws) < 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		strncpy(s_wait, server_ws, sizeof(s_wait) - 1);
+		parse_wait_strategy(optarg, &ws);
+		set_wait_strategy(ws);
+		break;
+		}
+
+		case 'E':
+		strncpy(s_engine, optarg, sizeof(s_engine) - 1);
+		break;
+
+		case 'S':
+		sharded = 1;
+		break;
+
+		case 'o':
+		out_of_order = 1;
+		break;
+
+		case 'P':
+		partitioned = 1;
+		break;
+
+		case 'A':
+		pin_server = 1;
+		break;
+
+		case 'C':
+		pin_clients = 1;
+		break;
+
+		case 'K':
+		hot_server = 1;
+		break;
+
+		case 'a':
+		attach = 1;
+		break;
+
+		case 'L':
+		strncpy(s_wal, optarg, sizeof(s_wal) - 1);
+		break;
+
+		case 'O': {
+		int n = sscanf(optarg, "%lf:%lf:%lf", &rate_start, &rate_end, &rate_step);
+		if (rate_start <= 0 || (n != 1 && (n != 3 || rate_end < rate_start || rate_step <= 0))) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (n == 1)
+			rate_step = 0;
+		break;
+		}
+
+		case 'V': {
+		int n = sscanf(optarg, "%u:%u", &value_min, &value_max);
+		if (n == 1)
+			value_max = value_min;
+		if (n < 1 || value_min < sizeof(value_type) || value_max < value_min || value_max > HEAP_MAX_VALUE) {
+			printf("Value sizes must be between %zu and %zu bytes\n", sizeof(value_type), HEAP_MAX_VALUE);
+			return 1;
+		}
+		break;
+		}
+
+		case 'B':
+		heap_mb = strtoull(optarg, NULL, 10);
+		break;
+
+		case 'D':
+		if (!strcmp(optarg, "poisson"))
+			poisson = 1;
+		else if (!strcmp(optarg, "fixed"))
+			poisson = 0;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'H':
+		strncpy(hist_file, optarg, sizeof(hist_file) - 1);
+		break;
+
+		case 'Z':
+		strncpy(s_snapshot, optarg, sizeof(s_snapshot) - 1);
+		break;
+
+		case 'z':
+		s_snapshot_period = atoi(optarg);
+		break;
+
+		case 'Q':
+		strncpy(s_mem_cap, optarg, sizeof(s_mem_cap) - 1);
+		break;
+
+		case 'Y':
+		strncpy(s_wal_sync, optarg, sizeof(s_wal_sync) - 1);
+		break;
+
+		case 'm':
+		multi_size = atoi(optarg);
+		if (multi_size < 1 || multi_size > MULTI_MAX) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'R':
+		if (!strcmp(optarg, "sem"))
+			ring_mode = RING_SEM;
+		else if (!strcmp(optarg, "lockfree"))
+			ring_mode = RING_LOCKFREE;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
 		default:
 		usage(argv[0]);
 		return 1;
 		}
 	}
+	if (sharded && partitioned) {
+		printf("-S and -P can't be used together\n");
+		return 1;
+	}
+	/* The server lays the region out, with one ring per client process */
+	if (attach && (sharded || partitioned || value_min > 0)) {
+		printf("-a can't be used with -S, -P or -V\n");
+		return 1;
+	}
+	/* A log or a snapshot would outlive the blobs its handles point at */
+	if (value_min > 0 && (s_wal[0] != '\0' || s_snapshot[0] != '\0')) {
+		printf("-V can't be used with -L or -Z\n");
+		return 1;
+	}
+	if (value_min > 0 && heap_mb < 1) {
+		printf("The value heap needs at least 1 MiB\n");
+		return 1;
+	}
 	return 0;
 }
 
-/* Return the elapsed time between two timespecs in ns. */
-double get_elapsed_ns(struct timespec *start, struct timespec *end) {
-    long es = end->tv_sec - start->tv_sec;
-    long ens = end->tv_nsec - start->tv_nsec;
-    double elapsed = es * 1e9 + ens;
-    return elapsed;
-}
-
 /* 
  * Reads the solution file
  * Line n of this file is a number which specifies the result of the nth get request
@@ -481,11 +1443,23 @@ void read_expected_file(FILE *f, value_type *exp) {
 int check_results(value_type *expected) {
 	int exp_idx = 0;
 	for (int i = 0; i < num_requests; i++) {
-		/* Only interested in GET requests */
-		if (requests[i].t != GET)
+		/* Only interested in the requests that return something */
+		if (requests[i].t == PUT)
 			continue;
 
 		/* Mismatch! */
+		if (results[i].v != expected[exp_idx] && requests[i].t == SCAN) {
+			fprintf(stderr, "Scan(%u, %u) returned pairs with digest %u instead of %u\n",
+					requests[i].k, requests[i].v, results[i].v, expected[exp_idx]);
+			fprintf(stderr, "Indices: req=%d exp=%d\n", i, exp_idx);
+			return 1;
+		}
+		if (results[i].v != expected[exp_idx] && requests[i].t != GET) {
+			fprintf(stderr, "%s(%u) found %u, but should have found %u\n", lat_names[requests[i].t],
+					requests[i].k, results[i].v, expected[exp_idx]);
+			fprintf(stderr, "Indices: req=%d exp=%d\n", i, exp_idx);
+			return 1;
+		}
 		if (results[i].v != expected[exp_idx]) {
 			fprintf(stderr, "Get(%u) should return %u, but got %u\n", 
 					results[i].k, expected[exp_idx], results[i].v);
@@ -499,6 +1473,48 @@ int check_results(value_type *expected) {
 	return 0;
 }
 
+/* Merge the latency histograms of the threads, type by type */
+void merge_latencies(struct hist merged[NUM_LAT]) {
+	for (int t = 0; t < NUM_LAT; t++) {
+		hist_init(&merged[t]);
+		for (int i = 0; i < num_threads; i++)
+			hist_merge(&merged[t], &contexts[i].lat[t]);
+	}
+}
+
+/*
+ * Merge the latency histograms of the threads, print their percentiles, and
+ * dump them to hist_file if it's set
+*/
+void print_latencies() {
+	static struct hist merged[NUM_LAT];
+	merge_latencies(merged);
+
+	printf("Latency (us):   count      p50      p90      p99    p99.9      max\n");
+	for (size_t i = 0; i < NUM_LAT_TYPES; i++) {
+		int t = lat_types[i];
+		struct hist *h = &merged[t];
+		if (h->total == 0)
+			continue;
+		printf("%-10s %10lu %8.1f %8.1f %8.1f %8.1f %8.1f\n", lat_names[t], h->total,
+		       hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+		       hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+		       h->max / 1e3);
+	}
+
+	if (hist_file[0] == '\0')
+		return;
+	FILE *f = fopen(hist_file, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return;
+	}
+	hist_print_csv_header(f);
+	for (size_t i = 0; i < NUM_LAT_TYPES; i++)
+		hist_print_csv(&merged[lat_types[i]], lat_names[lat_types[i]], f);
+	fclose(f);
+}
+
 /*
  * Check the correctness of the results and print performance numbers
  * @param s start timestamp
@@ -507,17 +1523,20 @@ int check_results(value_type *expected) {
 */
 int process_results(struct timespec *s, struct timespec *e) {
 	if (validate) {
-		value_type *expected = NULL;
-		FILE *f = fopen(expected_file, "r");
-		if (f == NULL)
-			perror("fopen");
-
-		int nl = count_lines(f);
-		expected = malloc(nl * sizeof(value_type));
-		if (expected == NULL)
-			perror("malloc");
+		uint64_t count;
+		value_type *expected = map_binary(expected_file, SOLUTION_MAGIC, sizeof(value_type), &count);
+		if (expected == NULL) {
+			FILE *f = fopen(expected_file, "r");
+			if (f == NULL)
+				perror("fopen");
+
+			int nl = count_lines(f);
+			expected = malloc(nl * sizeof(value_type));
+			if (expected == NULL)
+				perror("malloc");
 
-		read_expected_file(f, expected);
+			read_expected_file(f, expected);
+		}
 
 		if (check_results(expected) != 0)
 			return 1;
@@ -527,30 +1546,73 @@ int process_results(struct timespec *s, struct timespec *e) {
 	/* Throughput in K requests per second */
 	double tput = (num_requests * 1e6) / ns;
 	printf("Total time: %f ms\nThroughput: %f K/s\n", ns / 1e6, tput);
+	print_latencies();
 
 	/* No errors in check results */
 	return 0;
 }
 
+/*
+ * Run the workload open loop once per offered load of the sweep, printing
+ * the achieved throughput and the latency percentiles of each run - a
+ * throughput-latency curve
+*/
+void sweep_rates() {
+	static struct hist merged[NUM_LAT];
+	printf("offered(K/s) achieved(K/s)      p50      p90      p99    p99.9      max (us)\n");
+	for (double rate = rate_start; rate <= rate_end + 1e-9; rate += rate_step) {
+		struct timespec s, e;
+		clock_gettime(CLOCK_REALTIME, &s);
+		start_threads(rate);
+		wait_for_threads();
+		clock_gettime(CLOCK_REALTIME, &e);
+
+		merge_latencies(merged);
+		for (size_t i = 0; i < NUM_LAT_TYPES; i++)
+			if (lat_types[i] != GET)
+				hist_merge(&merged[GET], &merged[lat_types[i]]);
+		struct hist *h = &merged[GET];
+		printf("%12.1f %13.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", rate,
+		       num_requests * 1e6 / get_elapsed_ns(&s, &e),
+		       hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+		       hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+		       h->max / 1e3);
+		fflush(stdout);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	if (parse_args(argc, argv) != 0)
 		exit(EXIT_FAILURE);
 
-	init_client();
-
+	/* The workload decides how much room the shared memory needs */
 	read_input_files();
+	if (size_args() != 0)
+		exit(EXIT_FAILURE);
+
+	if (attach)
+		attach_client();
+	else
+		init_client();
+
+	if (rate_step > 0) {
+		sweep_rates();
+		detach_client();
+		stop_server();
+		return 0;
+	}
 
 	struct timespec s, e;
 	clock_gettime(CLOCK_REALTIME, &s);
 
-	start_threads();
+	start_threads(rate_start);
 	wait_for_threads();
 
 	clock_gettime(CLOCK_REALTIME, &e);
+	detach_client();
 
-	/* Kill the server app */
-	if (child_pid > 0)
-		kill(child_pid, SIGKILL);
+	/* Stop the server app */
+	stop_server();
 
 	return process_results(&s, &e);
 }
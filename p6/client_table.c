@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "client_table.h"
+#include "stats.h"
+
+static inline uint64_t align64(uint64_t x) {
+    return (x + 63) & ~63ull;
+}
+
+/* Where the table, the first area and the stats page go */
+static void client_layout(int max_clients, uint64_t area_size,
+                          uint64_t *clients_off, uint64_t *areas_off, uint64_t *stats_off) {
+    *clients_off = sizeof(struct ring) * (1 + (uint64_t) max_clients);
+    *areas_off = align64(*clients_off + sizeof(struct client_table) +
+                         max_clients * sizeof(struct client_slot));
+    *stats_off = *areas_off + max_clients * align64(area_size);
+}
+
+uint64_t client_region_size(int max_clients, uint64_t area_size, int stats_threads) {
+    uint64_t clients_off, areas_off, stats_off;
+    client_layout(max_clients, area_size, &clients_off, &areas_off, &stats_off);
+    return stats_off + stats_page_size(stats_threads);
+}
+
+int init_client_region(void *mem, int max_clients, uint64_t area_size, int stats_threads) {
+    uint64_t clients_off, areas_off, stats_off;
+    client_layout(max_clients, area_size, &clients_off, &areas_off, &stats_off);
+    struct ring *r = mem;
+    if (init_ring_mode(r, RING_LOCKFREE) < 0 || init_client_rings(r, max_clients) < 0)
+        return -1;
+
+    struct stats_page *stats = (struct stats_page*) ((char*) mem + stats_off);
+    stats->magic = STATS_MAGIC;
+    stats->num_threads = stats_threads;
+    r->stats_off = stats_off;
+    r->stats_threads = stats_threads;
+
+    r->clients_off = clients_off;
+    struct client_table *t = client_table(r);
+    t->max_clients = max_clients;
+    t->area_size = align64(area_size);
+    t->areas_off = areas_off;
+    __atomic_store_n(&t->magic, CLIENT_TABLE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* The byte of the file whose lock stands for the table (slot < 0) or a slot */
+static off_t lock_byte(struct ring *r, int slot) {
+    if (slot < 0)
+        return r->clients_off;
+    return r->clients_off + offsetof(struct client_table, slots) + slot * sizeof(struct client_slot);
+}
+
+/* Take (F_WRLCK) or drop (F_UNLCK) a lock without waiting for it */
+static int set_lock(int fd, off_t byte, short type) {
+    struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1};
+    return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+/* Whether some other open of the file holds the lock */
+static bool is_locked(int fd, off_t byte) {
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1};
+    return fcntl(fd, F_OFD_GETLK, &fl) != 0 || fl.l_type != F_UNLCK;
+}
+
+int client_table_own(struct ring *r, int fd) {
+    return set_lock(fd, lock_byte(r, -1), F_WRLCK) == 0 ? 0 : -1;
+}
+
+bool client_table_served(struct ring *r, int fd) {
+    return is_locked(fd, lock_byte(r, -1));
+}
+
+int client_attach(struct ring *r, int fd) {
+    struct client_table *t = client_table(r);
+    for (uint32_t i = 0; i < t->max_clients; i++) {
+        uint64_t state = __atomic_load_n(&t->slots[i].state, __ATOMIC_ACQUIRE);
+        if ((uint32_t) state != CLIENT_FREE)
+            continue;
+        // Lock first: the slot is only ever active while its lock is held
+        if (set_lock(fd, lock_byte(r, i), F_WRLCK) != 0)
+            continue; // Another client is claiming it
+        uint64_t claimed = ((state >> 32) + 1) << 32 | CLIENT_ACTIVE;
+        if (__atomic_compare_exchange_n(&t->slots[i].state, &state, claimed, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            t->slots[i].pid = getpid();
+            return i;
+        }
+        set_lock(fd, lock_byte(r, i), F_UNLCK);
+    }
+    return -1;
+}
+
+void client_detach(struct ring *r, int fd, int slot) {
+    struct client_table *t = client_table(r);
+    uint64_t state = __atomic_load_n(&t->slots[slot].state, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->slots[slot].state, (state & ~0xffffffffull) | CLIENT_FREE, __ATOMIC_SEQ_CST);
+    set_lock(fd, lock_byte(r, slot), F_UNLCK);
+}
+
+bool client_reap(struct ring *r, int fd, int slot, int *pid) {
+    struct client_table *t = client_table(r);
+    uint64_t state = __atomic_load_n(&t->slots[slot].state, __ATOMIC_SEQ_CST);
+    if ((uint32_t) state != CLIENT_ACTIVE || is_locked(fd, lock_byte(r, slot)))
+        return false;
+    // It may have been freed and claimed again since we loaded state - then
+    // the claim count moved on and the CAS fails
+    uint64_t dead = (state & ~0xffffffffull) | CLIENT_DEAD;
+    if (!__atomic_compare_exchange_n(&t->slots[slot].state, &state, dead, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return false;
+    *pid = t->slots[slot].pid;
+    return true;
+}
+
+void client_reset(struct ring *r, int slot) {
+    struct client_table *t = client_table(r);
+    // Drops whatever the client left in its ring, published or not
+    init_ring_mode(ring_shard(r, slot), RING_MPSC);
+    uint64_t state = __atomic_load_n(&t->slots[slot].state, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->slots[slot].state, (state & ~0xffffffffull) | CLIENT_FREE, __ATOMIC_SEQ_CST);
+}
+
+bool client_result_ok(struct client_table *t, int slot, struct buffer_descriptor *bd) {
+    uint64_t lo = client_area_off(t, slot), hi = lo + t->area_size;
+    return bd->res_off >= 0 && (uint64_t) bd->res_off >= lo &&
+           (uint64_t) bd->res_off + sizeof(struct buffer_descriptor) <= hi;
+}
+
+bool client_request_ok(struct client_table *t, int slot, struct buffer_descriptor *bd) {
+    uint64_t lo = client_area_off(t, slot), hi = lo + t->area_size;
+    if (!client_result_ok(t, slot, bd))
+        return false;
+    uint64_t pairs = bd->req_type == MGET || bd->req_type == MPUT ? bd->k :
+                     bd->req_type == SCAN ? bd->v : 0;
+    if (pairs == 0)
+        return true;
+    return bd->arg_off >= 0 && (uint64_t) bd->arg_off >= lo &&
+           (uint64_t) bd->arg_off + pairs * sizeof(struct kv_pair) <= hi;
+}
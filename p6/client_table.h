@@ -0,0 +1,125 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ring_buffer.h"
+
+/*
+ * Multi-client layout: the server (-M) creates the shared memory region and
+ * any number of client processes attach to it, each claiming a slot - a
+ * submission ring and an area of the region for its completion boards and
+ * MGET/MPUT/SCAN arrays:
+ * | RING | SLOT_0 RING | ... | SLOT_N RING | CLIENT TABLE | SLOT_0 AREA | ... | SLOT_N AREA | STATS |
+ * The slot rings are shards of the main ring (RING_MPSC, since a client's
+ * threads all submit to its ring): every server thread serves every slot,
+ * taking turns as the consumer of its ring, and sleeps on the main ring's
+ * doorbell.
+ *
+ * A client claims a free slot with a CAS on its state, and holds an OFD
+ * record lock on the slot's byte of the file for as long as it is attached.
+ * The kernel drops the lock when the client process dies however it dies,
+ * so the server finds dead clients by probing the locks of the active
+ * slots. The server holds the lock of the table's own byte, so clients can
+ * tell a live server from a stale region the same way.
+*/
+
+#define CLIENT_TABLE_MAGIC 0x7374656c62617463ull // "ctablets"
+
+/* Slot states, in the low half of client_slot.state - the high half counts
+ * the claims of the slot, so a reaper that saw an earlier client can't take
+ * the slot from the next one */
+#define CLIENT_FREE 0
+#define CLIENT_ACTIVE 1
+#define CLIENT_DEAD 2 /* Its client died, the server is resetting it */
+
+#define CLIENT_MAX 1024 /* Most slots a region can have */
+#define CLIENT_AREA_KIB 1024 /* Default size of a slot's area */
+
+struct __attribute__((aligned(64))) client_slot {
+    uint64_t state; // Claims << 32 | CLIENT_FREE, CLIENT_ACTIVE or CLIENT_DEAD
+    int32_t pid; // Of the client that last claimed it
+};
+
+/**
+ * Starts at ring.clients_off.
+*/
+struct __attribute__((aligned(64))) client_table {
+    uint64_t magic; // Set last, once the region is ready
+    uint32_t max_clients; // Entries of slots[], and slot rings
+    uint64_t area_size; // Bytes of each slot's area
+    uint64_t areas_off; // Offset in the region of slot 0's area
+    struct client_slot slots[];
+};
+
+static inline struct client_table *client_table(struct ring *r) {
+    return (struct client_table*) ((char*) r + r->clients_off);
+}
+
+static inline uint64_t client_area_off(struct client_table *t, int slot) {
+    return t->areas_off + slot * t->area_size;
+}
+
+static inline bool client_active(struct client_table *t, int slot) {
+    return (uint32_t) __atomic_load_n(&t->slots[slot].state, __ATOMIC_SEQ_CST) == CLIENT_ACTIVE;
+}
+
+/**
+ * Size of a region for max_clients slots of area_size bytes, with a stats
+ * page for stats_threads server threads.
+*/
+uint64_t client_region_size(int max_clients, uint64_t area_size, int stats_threads);
+
+/**
+ * Lay the region out over a zeroed mem of client_region_size() bytes: the
+ * main ring, the slot rings, the table and the stats page. The table's magic
+ * is set last.
+ * @return 0 on success, -1 if a ring couldn't be initialized.
+*/
+int init_client_region(void *mem, int max_clients, uint64_t area_size, int stats_threads);
+
+/**
+ * Server: take the table's lock, which clients check to see we're alive.
+ * @param fd the region's file, kept open for as long as we serve.
+ * @return 0 on success, -1 on error.
+*/
+int client_table_own(struct ring *r, int fd);
+
+/**
+ * Client: whether a server holds the table of the region (see
+ * client_table_own()).
+*/
+bool client_table_served(struct ring *r, int fd);
+
+/**
+ * Client: claim a free slot, locking it through fd, which has to stay open
+ * until client_detach().
+ * @return the slot, -1 if they're all taken.
+*/
+int client_attach(struct ring *r, int fd);
+
+/**
+ * Client: give the slot back - nothing may be in flight on it any more.
+*/
+void client_detach(struct ring *r, int fd, int slot);
+
+/**
+ * Server: whether the client of an active slot died (its lock is gone) -
+ * if so, the slot is now CLIENT_DEAD and its pid is in *pid.
+*/
+bool client_reap(struct ring *r, int fd, int slot, int *pid);
+
+/**
+ * Server: put a dead slot back in service once nobody touches its ring or
+ * area any more.
+*/
+void client_reset(struct ring *r, int slot);
+
+/**
+ * Server: whether the request's result is in the slot's own area.
+*/
+bool client_result_ok(struct client_table *t, int slot, struct buffer_descriptor *bd);
+
+/**
+ * Server: whether the request only points at the slot's own area.
+*/
+bool client_request_ok(struct client_table *t, int slot, struct buffer_descriptor *bd);
@@ -5,6 +5,110 @@ typedef uint32_t key_type;
 typedef uint32_t value_type;
 typedef uint32_t index_t;
 
-static index_t hash_function(key_type k, int table_size) {
-	return k % table_size;
+/* One element of the key/value arrays MGET and MPUT requests point to */
+struct kv_pair {
+	key_type k;
+	value_type v;
+};
+
+/* What a read-modify-write does to the value of a key - a key that isn't
+ * present reads as 0 */
+enum kv_op {
+	KV_SET = 0, /* v (a plain put, or a get-and-set) */
+	KV_ADD,     /* the value plus v */
+	KV_CAS      /* v if the value is cmp, the value otherwise */
+};
+
+/* The value an update leaves, given the one it found */
+static inline value_type kv_apply(enum kv_op op, value_type cur, value_type v, value_type cmp) {
+	if (op == KV_ADD)
+		return cur + v;
+	return op == KV_CAS && cur != cmp ? cur : v;
+}
+
+/* Whether an update of a key that isn't present puts it - a put always
+ * does, but an update that leaves 0 is as good as not there */
+static inline int kv_inserts(enum kv_op op, value_type v, value_type cmp) {
+	return op == KV_SET || kv_apply(op, 0, v, cmp) != 0;
+}
+
+/* Hash policies - pick one at compile time, e.g. make HASH=MURMUR (after a
+ * make clean), so hash_function() stays a single inlined expression */
+#define HASH_MODULO 0    /* k % table_size */
+#define HASH_FIBONACCI 1 /* multiply by 2^32 / golden ratio, keep the high bits */
+#define HASH_MURMUR 2    /* murmur3's 32-bit finalizer */
+
+#ifndef HASH_POLICY
+#define HASH_POLICY HASH_MODULO
+#endif
+
+/* With HASH_POW2 set, tables are sized to powers of two and HASH_MODULO
+ * reduces with a mask instead of a division (the other policies never
+ * divide, they scale the hash onto the table) */
+#ifndef HASH_POW2
+#define HASH_POW2 0
+#endif
+
+static inline uint32_t hash_fibonacci(key_type k) {
+	return k * 2654435769u;
+}
+
+static inline uint32_t hash_murmur(key_type k) {
+	k ^= k >> 16;
+	k *= 0x85ebca6b;
+	k ^= k >> 13;
+	k *= 0xc2b2ae35;
+	k ^= k >> 16;
+	return k;
+}
+
+/* Map a hash onto [0, table_size) by its high bits - no division needed */
+static inline index_t reduce_high(uint32_t h, int table_size) {
+	return (index_t) (((uint64_t) h * (uint32_t) table_size) >> 32);
+}
+
+/* Map a hash onto [0, table_size) by its low bits */
+static inline index_t reduce_low(uint32_t h, int table_size) {
+#if HASH_POW2
+	return h & (table_size - 1);
+#else
+	return h % table_size;
+#endif
+}
+
+/* Smallest power of two >= n */
+static inline int table_size_pow2(int n) {
+	int size = 1;
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+/* Number of indices a table asked to have n of should get */
+static inline int table_size_for(int n) {
+#if HASH_POW2
+	return table_size_pow2(n);
+#else
+	return n;
+#endif
+}
+
+/* Mixed into a key before it's hashed for its partition */
+#define PARTITION_SEED 0x5bd1e995u
+
+/* Partition (of n) of a partitioned server that owns k - a hash of its own,
+ * independent of hash_function() (even under HASH_MURMUR), so each
+ * partition's keys still spread over all of its table */
+static inline int key_partition(key_type k, int n) {
+	return reduce_high(hash_murmur(k ^ PARTITION_SEED), n);
+}
+
+static inline index_t hash_function(key_type k, int table_size) {
+#if HASH_POLICY == HASH_FIBONACCI
+	return reduce_high(hash_fibonacci(k), table_size);
+#elif HASH_POLICY == HASH_MURMUR
+	return reduce_high(hash_murmur(k), table_size);
+#else
+	return reduce_low(k, table_size);
+#endif
 }
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+#include "workload.h"
+
+/*
+ * Generates a workload and its solution, like gen_workload.py but fast and
+ * without numpy: num_reqs * ratio puts of distinct (uniform) or zipf keys,
+ * interleaved at random with gets (or, with -q, scans, and with -u, atomic
+ * read-modify-writes) of the keys that are put. Writes the binary formats
+ * of workload.h by default, or the text formats with -t.
+*/
+
+#define MIN_VALUE 1
+#define MAX_VALUE 4000000000u
+
+int num_reqs = 100;
+double skew = 0;
+double ratio = 0.5;
+double scan_ratio = 0; /* share of the non-put requests that are scans */
+int scan_len = 16; /* longest scan */
+double rmw_ratio = 0; /* share of the non-put requests that are ADDs, CASes or SWAPs */
+int text = 0;
+uint64_t seed = 537;
+char workload_file[256];
+char solution_file[256];
+
+/* splitmix64 */
+static uint64_t rand64() {
+	uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+/* Uniform double in (0, 1] */
+static double rand01() {
+	return ((rand64() >> 11) + 1.0) / (double) (1ull << 53);
+}
+
+/* Uniform integer in [0, n) */
+static uint64_t rand_below(uint64_t n) {
+	return rand64() % n;
+}
+
+/*
+ * The state of the store while we replay the workload, to know what each get
+ * returns - open addressing, key 0 (which we never generate) marks free slots
+*/
+struct sim_table {
+	key_type *keys;
+	value_type *vals;
+	uint64_t mask;
+};
+
+static void sim_init(struct sim_table *t, uint64_t n) {
+	uint64_t size = 2;
+	while (size < 2 * n)
+		size <<= 1;
+	t->keys = calloc(size, sizeof(key_type));
+	t->vals = calloc(size, sizeof(value_type));
+	if (t->keys == NULL || t->vals == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	t->mask = size - 1;
+}
+
+static uint64_t sim_slot(struct sim_table *t, key_type k) {
+	uint64_t i = hash_murmur(k) & t->mask;
+	while (t->keys[i] != 0 && t->keys[i] != k)
+		i = (i + 1) & t->mask;
+	return i;
+}
+
+static void sim_put(struct sim_table *t, key_type k, value_type v) {
+	uint64_t i = sim_slot(t, k);
+	t->keys[i] = k;
+	t->vals[i] = v;
+}
+
+static value_type sim_get(struct sim_table *t, key_type k) {
+	return t->vals[sim_slot(t, k)];
+}
+
+static int sim_has(struct sim_table *t, key_type k) {
+	return t->keys[sim_slot(t, k)] == k;
+}
+
+/*
+ * The order of the keys put so far, for scans: the distinct keys of the
+ * workload, sorted, and a bitmap of the ones that have been put - plus a
+ * bit per word of the bitmap, set if the word has any, to skip over long
+ * runs of keys that haven't been put yet
+*/
+struct sim_order {
+	key_type *keys;
+	uint64_t n;
+	uint64_t *bits;
+	uint64_t *words;
+	uint64_t num_bits_words;
+};
+
+static int cmp_key(const void *a, const void *b) {
+	key_type x = *(const key_type *) a, y = *(const key_type *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void order_init(struct sim_order *o, const key_type *keys, uint64_t n) {
+	o->keys = malloc(sizeof(key_type) * (n > 0 ? n : 1));
+	if (o->keys == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(o->keys, keys, sizeof(key_type) * n);
+	qsort(o->keys, n, sizeof(key_type), cmp_key);
+	o->n = 0;
+	for (uint64_t i = 0; i < n; i++)
+		if (o->n == 0 || o->keys[o->n - 1] != o->keys[i])
+			o->keys[o->n++] = o->keys[i];
+	o->num_bits_words = (o->n + 63) / 64;
+	o->bits = calloc(o->num_bits_words + 1, sizeof(uint64_t));
+	o->words = calloc(o->num_bits_words / 64 + 1, sizeof(uint64_t));
+	if (o->bits == NULL || o->words == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Index of the first key >= k (n if there is none) */
+static uint64_t order_lower_bound(struct sim_order *o, key_type k) {
+	uint64_t lo = 0, hi = o->n;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (o->keys[mid] < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void order_put(struct sim_order *o, key_type k) {
+	uint64_t i = order_lower_bound(o, k);
+	o->bits[i / 64] |= 1ull << (i % 64);
+	o->words[i / 4096] |= 1ull << (i / 64 % 64);
+}
+
+/* Index of the first key at or after i that has been put (n if none) */
+static uint64_t order_next(struct sim_order *o, uint64_t i) {
+	if (i >= o->n)
+		return o->n;
+	uint64_t w = i / 64;
+	uint64_t m = o->bits[w] & (~0ull << (i % 64));
+	if (m != 0)
+		return w * 64 + __builtin_ctzll(m);
+	for (w++; w < o->num_bits_words; w = (w / 64 + 1) * 64) {
+		m = o->words[w / 64] & (~0ull << (w % 64));
+		if (m != 0) {
+			w = w / 64 * 64 + __builtin_ctzll(m);
+			return w * 64 + __builtin_ctzll(o->bits[w]);
+		}
+	}
+	return o->n;
+}
+
+static FILE *open_output(const char *name, const char *magic, uint64_t count) {
+	FILE *f = fopen(name, "w");
+	if (f == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	if (!text) {
+		struct workload_header hdr = {.count = count};
+		memcpy(hdr.magic, magic, sizeof(hdr.magic));
+		fwrite(&hdr, sizeof(hdr), 1, f);
+	}
+	return f;
+}
+
+void generate() {
+	uint64_t num_put = (uint64_t) (num_reqs * ratio);
+	uint64_t num_get = num_reqs - num_put;
+
+	/* Keys of the puts: a shuffled 1..num_put, or zipf samples */
+	key_type *keys = malloc(sizeof(key_type) * (num_put > 0 ? num_put : 1));
+	if (keys == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i < num_put; i++)
+		keys[i] = skew <= 1 ? i + 1 : zipf_sample(skew, rand01);
+	for (uint64_t i = num_put; i > 1; i--) {
+		uint64_t j = rand_below(i);
+		key_type tmp = keys[i - 1];
+		keys[i - 1] = keys[j];
+		keys[j] = tmp;
+	}
+
+	struct sim_table sim;
+	sim_init(&sim, num_put);
+	struct sim_order order;
+	if (scan_ratio > 0)
+		order_init(&order, keys, num_put);
+	FILE *wf = open_output(workload_file, WORKLOAD_MAGIC, num_reqs);
+	FILE *sf = open_output(solution_file, SOLUTION_MAGIC, num_get);
+	uint64_t n = 0, m = 0;
+	while (n < num_put || m < num_get) {
+		struct request r = {0};
+		double u = 1; /* picks a scan, a read-modify-write or a get */
+		if (n < num_put && (m == num_get || rand01() <= ratio)) {
+			r.t = PUT;
+			r.k = keys[n++];
+			r.v = MIN_VALUE + rand_below(MAX_VALUE - MIN_VALUE);
+			sim_put(&sim, r.k, r.v);
+			if (scan_ratio > 0)
+				order_put(&order, r.k);
+		}
+		else if ((scan_ratio > 0 || rmw_ratio > 0) && (u = rand01()) <= scan_ratio) {
+			r.t = SCAN;
+			r.k = num_put > 0 ? keys[rand_below(num_put)] : 1;
+			r.v = 1 + rand_below(scan_len);
+			uint32_t expected = SCAN_DIGEST_SEED;
+			uint64_t i = order_lower_bound(&order, r.k);
+			for (uint32_t j = 0; j < r.v && (i = order_next(&order, i)) < order.n; j++, i++)
+				expected = scan_digest_add(expected, order.keys[i], sim_get(&sim, order.keys[i]));
+			if (text)
+				fprintf(sf, "%u\n", expected);
+			else
+				fwrite(&expected, sizeof(expected), 1, sf);
+			m++;
+		}
+		else if (u <= scan_ratio + rmw_ratio) {
+			/* As many ADDs as CASes (half of which find the value they
+			 * expect) and SWAPs; each returns the value it found */
+			static const enum kv_op ops[] = {[ADD] = KV_ADD, [CAS] = KV_CAS, [SWAP] = KV_SET};
+			r.t = ADD + rand_below(3);
+			r.k = num_put > 0 ? keys[rand_below(num_put)] : 1;
+			value_type found = sim_get(&sim, r.k);
+			if (r.t == ADD)
+				r.v = 1 + rand_below(1000);
+			else
+				r.v = MIN_VALUE + rand_below(MAX_VALUE - MIN_VALUE);
+			if (r.t == CAS)
+				r.cmp = rand_below(2) ? found : found + 1;
+			if (sim_has(&sim, r.k) || kv_inserts(ops[r.t], r.v, r.cmp)) {
+				sim_put(&sim, r.k, kv_apply(ops[r.t], found, r.v, r.cmp));
+				if (scan_ratio > 0)
+					order_put(&order, r.k);
+			}
+			if (text)
+				fprintf(sf, "%u\n", found);
+			else
+				fwrite(&found, sizeof(found), 1, sf);
+			m++;
+		}
+		else {
+			r.t = GET;
+			r.k = num_put > 0 ? keys[rand_below(num_put)] : 1;
+			r.v = 0;
+			value_type expected = sim_get(&sim, r.k);
+			if (text)
+				fprintf(sf, "%u\n", expected);
+			else
+				fwrite(&expected, sizeof(expected), 1, sf);
+			m++;
+		}
+		if (!text)
+			fwrite(&r, sizeof(r), 1, wf);
+		else if (r.t == PUT)
+			fprintf(wf, "put %u %u\n", r.k, r.v);
+		else if (r.t == SCAN)
+			fprintf(wf, "scan %u %u\n", r.k, r.v);
+		else if (r.t == ADD)
+			fprintf(wf, "add %u %u\n", r.k, r.v);
+		else if (r.t == CAS)
+			fprintf(wf, "cas %u %u %u\n", r.k, r.cmp, r.v);
+		else if (r.t == SWAP)
+			fprintf(wf, "swap %u %u\n", r.k, r.v);
+		else
+			fprintf(wf, "get %u\n", r.k);
+	}
+	fclose(wf);
+	fclose(sf);
+	free(keys);
+	free(sim.keys);
+	free(sim.vals);
+	if (scan_ratio > 0) {
+		free(order.keys);
+		free(order.bits);
+		free(order.words);
+	}
+	printf("Workload generated and saved to %s (solution in %s)\n", workload_file, solution_file);
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-n num_reqs] [-s skew] [-r ratio] [-q scan_ratio] [-l scan_len] [-u rmw_ratio] [-t] [-S seed] [-i workload_file] [-e solution_file]\n", name);
+	printf("-n number of requests (default: %d)\n", num_reqs);
+	printf("-s skew: [0, 1] for distinct keys, > 1 for zipf distributed keys (default: %.1f)\n", skew);
+	printf("-r ratio of put requests (default: %.1f)\n", ratio);
+	printf("-q share of the non-put requests that are scans of up to scan_len keys instead of gets (default: %.1f)\n", scan_ratio);
+	printf("-l longest scan, in keys (default: %d, max %d)\n", scan_len, MULTI_MAX);
+	printf("-u share of the non-put requests that are read-modify-writes (add, cas or swap, evenly) instead of gets - with -q, the two shares add up (default: %.1f)\n", rmw_ratio);
+	printf("-t write the text formats (workload.txt/solution.txt) instead of the binary ones\n");
+	printf("-S seed of the random generator (default: %lu)\n", seed);
+	printf("-i workload file name (default: workload.bin, workload.txt with -t)\n");
+	printf("-e solution file name (default: solution.bin, solution.txt with -t)\n");
+}
+
+int main(int argc, char *argv[]) {
+	workload_file[0] = solution_file[0] = '\0';
+	int op;
+	while ((op = getopt(argc, argv, "hn:s:r:q:l:u:tS:i:e:")) != -1) {
+		switch (op) {
+		case 'n':
+		num_reqs = atoi(optarg);
+		break;
+
+		case 's':
+		skew = atof(optarg);
+		break;
+
+		case 'r':
+		ratio = atof(optarg);
+		break;
+
+		case 'q':
+		scan_ratio = atof(optarg);
+		break;
+
+		case 'l':
+		scan_len = atoi(optarg);
+		break;
+
+		case 'u':
+		rmw_ratio = atof(optarg);
+		break;
+
+		case 't':
+		text = 1;
+		break;
+
+		case 'S':
+		seed = strtoull(optarg, NULL, 10);
+		break;
+
+		case 'i':
+		strncpy(workload_file, optarg, sizeof(workload_file) - 1);
+		break;
+
+		case 'e':
+		strncpy(solution_file, optarg, sizeof(solution_file) - 1);
+		break;
+
+		case 'h':
+		usage(argv[0]);
+		return 0;
+
+		default:
+		usage(argv[0]);
+		return 1;
+		}
+	}
+	if (num_reqs < 0 || ratio < 0 || ratio > 1 || skew < 0 || scan_ratio < 0 || rmw_ratio < 0 || scan_ratio + rmw_ratio > 1 ||
+	    scan_len < 1 || scan_len > MULTI_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (workload_file[0] == '\0')
+		strcpy(workload_file, text ? "workload.txt" : "workload.bin");
+	if (solution_file[0] == '\0')
+		strcpy(solution_file, text ? "solution.txt" : "solution.bin");
+
+	generate();
+	return 0;
+}
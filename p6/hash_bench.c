@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "common.h"
+#include "workload.h"
+
+/*
+ * Compares the hash policies of common.h on the key patterns the workloads
+ * produce: how evenly they spread keys over a table (chain lengths) and how
+ * fast they map a key to an index. hash_function() itself is fixed at
+ * compile time, so this calls the building blocks directly.
+*/
+
+#define REPEAT 20
+
+struct policy {
+	const char *name;
+	int pow2; /* needs a power-of-two table */
+	index_t (*index)(key_type k, int table_size);
+	/* Sum of the indices of n keys, repeated REPEAT times - the whole loop
+	 * per policy, so the mapping is inlined like hash_function() is */
+	index_t (*index_all)(key_type *keys, int n, int table_size);
+};
+
+static inline index_t index_modulo(key_type k, int table_size) {
+	return k % table_size;
+}
+
+static inline index_t index_mask(key_type k, int table_size) {
+	return k & (table_size - 1);
+}
+
+static inline index_t index_fibonacci(key_type k, int table_size) {
+	return reduce_high(hash_fibonacci(k), table_size);
+}
+
+static inline index_t index_murmur(key_type k, int table_size) {
+	return reduce_high(hash_murmur(k), table_size);
+}
+
+#define INDEX_ALL(name) \
+	static index_t name##_all(key_type *keys, int n, int table_size) { \
+		index_t acc = 0; \
+		for (int r = 0; r < REPEAT; r++) \
+			for (int i = 0; i < n; i++) \
+				acc += name(keys[i], table_size); \
+		return acc; \
+	}
+
+INDEX_ALL(index_modulo)
+INDEX_ALL(index_mask)
+INDEX_ALL(index_fibonacci)
+INDEX_ALL(index_murmur)
+
+static struct policy policies[] = {
+	{ "modulo", 0, index_modulo, index_modulo_all },
+	{ "mask", 1, index_mask, index_mask_all },
+	{ "fibonacci", 0, index_fibonacci, index_fibonacci_all },
+	{ "murmur", 0, index_murmur, index_murmur_all },
+};
+
+int num_keys = 1 << 20;
+int table_size = 1 << 18;
+double skew = 1.2;
+
+/* Uniform double in (0, 1] */
+static double rand01() {
+	return (random() + 1.0) / ((double) RAND_MAX + 1.0);
+}
+
+static int cmp_keys(const void *a, const void *b) {
+	key_type x = *(const key_type *) a, y = *(const key_type *) b;
+	return (x > y) - (x < y);
+}
+
+/* Fill keys with the given pattern and return the number of distinct keys */
+static int gen_keys(const char *dist, key_type *keys, int n) {
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(dist, "sequential"))
+			keys[i] = i + 1;
+		else if (!strcmp(dist, "strided"))
+			keys[i] = (key_type) (i + 1) << 10;
+		else if (!strcmp(dist, "zipf"))
+			keys[i] = zipf_sample(skew, rand01);
+		else
+			keys[i] = (key_type) random() ^ ((key_type) random() << 16);
+	}
+	/* Chains only hold distinct keys */
+	qsort(keys, n, sizeof(key_type), cmp_keys);
+	int distinct = 0;
+	for (int i = 0; i < n; i++)
+		if (i == 0 || keys[i] != keys[i - 1])
+			keys[distinct++] = keys[i];
+	return distinct;
+}
+
+static void run(const char *dist, key_type *keys, int n, struct policy *p, int *counts) {
+	int size = p->pow2 ? table_size_pow2(table_size) : table_size;
+	memset(counts, 0, size * sizeof(int));
+	for (int i = 0; i < n; i++)
+		counts[p->index(keys[i], size)]++;
+
+	int empty = 0, max = 0;
+	int hist[6] = {0}; /* chains of length 1, 2, 3, 4, 5-8, 9+ */
+	for (int i = 0; i < size; i++) {
+		int c = counts[i];
+		if (c == 0)
+			empty++;
+		else
+			hist[c <= 4 ? c - 1 : (c <= 8 ? 4 : 5)]++;
+		if (c > max)
+			max = c;
+	}
+
+	struct timespec s, e;
+	volatile index_t sink = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	index_t acc = p->index_all(keys, n, size);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	sink = acc;
+	(void) sink;
+	double mops = (double) n * REPEAT / get_elapsed_ns(&s, &e) * 1e3;
+
+	printf("%-10s %-10s %8d %8d %6.1f%% %6.2f %6d | %6.1f%% %6.1f%% %6.1f%% %6.1f%% %6.1f%% %6.1f%% | %8.1f\n",
+		dist, p->name, n, size, 100.0 * empty / size,
+		size > empty ? (double) n / (size - empty) : 0.0, max,
+		100.0 * hist[0] / size, 100.0 * hist[1] / size, 100.0 * hist[2] / size,
+		100.0 * hist[3] / size, 100.0 * hist[4] / size, 100.0 * hist[5] / size, mops);
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-n num_keys] [-s table_size] [-z skew]\n", name);
+	printf("-h show this help\n");
+	printf("-n number of keys to draw for each pattern (default: %d)\n", num_keys);
+	printf("-s number of indices of the table (default: %d, rounded up to a power of two for mask)\n", table_size);
+	printf("-z skew of the zipf pattern, > 1 (default: %.1f)\n", skew);
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hn:s:z:")) != -1) {
+		switch (op) {
+		case 'n':
+		num_keys = atoi(optarg);
+		break;
+
+		case 's':
+		table_size = atoi(optarg);
+		break;
+
+		case 'z':
+		skew = atof(optarg);
+		break;
+
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+
+		default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+		}
+	}
+	if (num_keys < 1 || table_size < 1 || skew <= 1.0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	key_type *keys = malloc(num_keys * sizeof(key_type));
+	int *counts = malloc(table_size_pow2(table_size) * sizeof(int));
+	if (keys == NULL || counts == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	const char *dists[] = { "sequential", "strided", "zipf", "random" };
+	printf("%-10s %-10s %8s %8s %7s %6s %6s | %7s %7s %7s %7s %7s %7s | %8s\n",
+		"pattern", "policy", "distinct", "indices", "empty", "chain", "max",
+		"len=1", "len=2", "len=3", "len=4", "5-8", "9+", "Mops/s");
+	for (int d = 0; d < 4; d++) {
+		srandom(537);
+		int n = gen_keys(dists[d], keys, num_keys);
+		for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+			run(dists[d], keys, n, &policies[p], counts);
+	}
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include <string.h>
+
+#include "hist.h"
+
+void hist_init(struct hist *h) {
+    memset(h, 0, sizeof(struct hist));
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_bucket_low(int i) {
+    if (i < HIST_SUB_COUNT)
+        return i;
+    int shift = i / HIST_SUB_COUNT - 1;
+    return (uint64_t) (HIST_SUB_COUNT + i % HIST_SUB_COUNT) << shift;
+}
+
+uint64_t hist_bucket_high(int i) {
+    if (i < HIST_SUB_COUNT)
+        return i;
+    int shift = i / HIST_SUB_COUNT - 1;
+    return hist_bucket_low(i) + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p) {
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (p * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+void hist_print_csv_header(FILE *f) {
+    fprintf(f, "name,low,high,count\n");
+}
+
+void hist_print_csv(const struct hist *h, const char *name, FILE *f) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        if (h->counts[i] > 0)
+            fprintf(f, "%s,%lu,%lu,%lu\n", name, hist_bucket_low(i), hist_bucket_high(i), h->counts[i]);
+}
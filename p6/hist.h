@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+/* Each power of two range of values is split into 2^HIST_SUB_BITS linear
+ * sub-buckets, so a recorded value is off by at most 1/2^HIST_SUB_BITS
+ * (3%) - values below 2^HIST_SUB_BITS are exact */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/* A log-linear (HDR-style) histogram of 64-bit values, e.g. latencies in ns */
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+void hist_init(struct hist *h);
+
+/* Bucket v falls into */
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_COUNT)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int) ((v >> shift) - HIST_SUB_COUNT);
+}
+
+static inline void hist_record(struct hist *h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Add the counts of src to dst */
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/* Smallest and largest value bucket i holds */
+uint64_t hist_bucket_low(int i);
+uint64_t hist_bucket_high(int i);
+
+/*
+ * Get the value below which a fraction p (e.g. 0.99) of the recorded values
+ * are, rounded up to the end of its bucket (but never above the max)
+ * @return 0 if nothing was recorded
+*/
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/*
+ * Write the non-empty buckets as CSV rows: name,low,high,count
+ * (see hist_print_csv_header())
+*/
+void hist_print_csv_header(FILE *f);
+void hist_print_csv(const struct hist *h, const char *name, FILE *f);
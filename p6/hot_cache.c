@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hot_cache.h"
+
+int init_hot_versions(struct hot_versions *hv, int bits) {
+    hv->v = calloc((size_t) 1 << bits, sizeof(uint32_t));
+    if (hv->v == NULL)
+        return -1;
+    hv->mask = (1u << bits) - 1;
+    return 0;
+}
+
+void hot_cache_init(struct hot_cache *c, struct hot_versions *hv) {
+    memset(c, 0, sizeof(struct hot_cache));
+    c->versions = hv;
+}
+
+/* Counter of row for a key hashing to h - each row scrambles h its own way */
+static inline uint8_t *sketch_counter(struct hot_cache *c, int row, uint32_t h) {
+    static const uint32_t seeds[HOT_SKETCH_ROWS] = {0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu};
+    return &c->sketch[row][(h * seeds[row]) >> (32 - HOT_SKETCH_BITS)];
+}
+
+static void sketch_add(struct hot_cache *c, uint32_t h) {
+    for (int row = 0; row < HOT_SKETCH_ROWS; row++) {
+        uint8_t *cnt = sketch_counter(c, row, h);
+        if (*cnt < UINT8_MAX)
+            (*cnt)++;
+    }
+    if (++c->accesses < HOT_AGE_PERIOD)
+        return;
+    for (int row = 0; row < HOT_SKETCH_ROWS; row++)
+        for (int i = 0; i < 1 << HOT_SKETCH_BITS; i++)
+            c->sketch[row][i] >>= 1;
+    c->accesses = 0;
+}
+
+static uint32_t sketch_estimate(struct hot_cache *c, uint32_t h) {
+    uint32_t min = UINT8_MAX;
+    for (int row = 0; row < HOT_SKETCH_ROWS; row++) {
+        uint8_t cnt = *sketch_counter(c, row, h);
+        if (cnt < min)
+            min = cnt;
+    }
+    return min;
+}
+
+static inline struct hot_entry *hot_entry_of(struct hot_cache *c, key_type k) {
+    return &c->entries[hash_fibonacci(k) >> (32 - HOT_CACHE_BITS)];
+}
+
+bool hot_lookup(struct hot_cache *c, key_type k, value_type *v, uint32_t *version) {
+    sketch_add(c, hash_murmur(k));
+    struct hot_entry *e = hot_entry_of(c, k);
+    // Load the version before the table is read, so a PUT racing with that
+    // read leaves the entry we fill stale rather than wrong
+    uint32_t cur = __atomic_load_n(hot_stripe(c->versions, k), __ATOMIC_SEQ_CST);
+    if (e->used && e->k == k) {
+        if (e->version == cur) {
+            *v = e->v;
+            return true;
+        }
+        e->used = false;
+    }
+    *version = cur;
+    return false;
+}
+
+void hot_fill(struct hot_cache *c, key_type k, value_type v, uint32_t version) {
+    struct hot_entry *e = hot_entry_of(c, k);
+    uint32_t freq = sketch_estimate(c, hash_murmur(k));
+    if (freq < HOT_MIN_FREQ)
+        return;
+    if (e->used && e->k != k && sketch_estimate(c, hash_murmur(e->k)) >= freq)
+        return;
+    e->k = k;
+    e->v = v;
+    e->version = version;
+    e->used = true;
+}
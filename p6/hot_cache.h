@@ -0,0 +1,83 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "common.h"
+
+/* Entries of a thread's cache (direct mapped) */
+#define HOT_CACHE_BITS 8
+
+/* Count-min sketch: rows of 2^HOT_SKETCH_BITS saturating counters */
+#define HOT_SKETCH_ROWS 4
+#define HOT_SKETCH_BITS 10
+
+/* Estimated recent accesses a key needs before it may be cached */
+#define HOT_MIN_FREQ 4
+
+/* Accesses after which every sketch counter is halved, so keys that
+ * cooled down make room for the ones that are hot now */
+#define HOT_AGE_PERIOD (16 << HOT_SKETCH_BITS)
+
+/* Version stripes shared by all threads */
+#define HOT_VERSION_BITS 16
+
+/**
+ * Versions of the keys, bumped on every PUT after the table is updated.
+ * Keys share a stripe with the others that hash to it, which only costs
+ * a spurious miss now and then.
+*/
+struct hot_versions {
+    uint32_t *v;
+    uint32_t mask;
+};
+
+struct hot_entry {
+    key_type k;
+    value_type v;
+    uint32_t version; // Of k's stripe when v was read from the table
+    bool used;
+};
+
+/**
+ * A server thread's private cache of the values of the hottest keys it
+ * reads, so they stop pulling the table's cache lines over from the
+ * threads that write them. A key only goes in once the sketch says it is
+ * read often, and only evicts a key the sketch says is read less.
+*/
+struct hot_cache {
+    struct hot_versions *versions;
+    struct hot_entry entries[1 << HOT_CACHE_BITS];
+    uint8_t sketch[HOT_SKETCH_ROWS][1 << HOT_SKETCH_BITS];
+    uint32_t accesses; // Since the sketch was last aged
+};
+
+/**
+ * Initialize the versions, with 2^bits stripes.
+ * @return 0 on success, -1 if they can't be allocated.
+*/
+int init_hot_versions(struct hot_versions *hv, int bits);
+
+void hot_cache_init(struct hot_cache *c, struct hot_versions *hv);
+
+static inline uint32_t *hot_stripe(struct hot_versions *hv, key_type k) {
+    return &hv->v[hash_murmur(k) & hv->mask];
+}
+
+/* Invalidate the cached copies of k - call after k's value changed */
+static inline void hot_invalidate(struct hot_versions *hv, key_type k) {
+    __atomic_fetch_add(hot_stripe(hv, k), 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Look k up in the cache, counting the access in the sketch.
+ * @param v set to the cached value on a hit.
+ * @param version set on a miss: pass it to hot_fill() along with the value
+ *                read from the table after this call.
+ * @return true on a hit.
+*/
+bool hot_lookup(struct hot_cache *c, key_type k, value_type *v, uint32_t *version);
+
+/**
+ * Offer the value of k, read from the table after hot_lookup() missed, to
+ * the cache - it keeps it if k is hot enough.
+*/
+void hot_fill(struct hot_cache *c, key_type k, value_type v, uint32_t version);
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,158 +10,563 @@
 #include <sys/types.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include "bench_util.h"
 #include "ring_buffer.h"
 #include "common.h"
+#include "kv_table.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "hot_cache.h"
+#include "value_heap.h"
+#include "client_table.h"
 
 #define MAX_THREADS 128
+#define MAX_BATCH RING_SIZE
+#define REAP_INTERVAL_MS 100 // How often we look for dead clients
 
-/**
- * A linked list node representing a key-value pair.
-*/
-struct keyvalue_node {
-    key_type k;
-    value_type v;
-    struct keyvalue_node *next;
-};
+struct kv_store hashtable;
+struct kv_store partitions[MAX_THREADS]; // Partitioned mode: thread i's own table
+enum kv_engine engine = ENGINE_CHAIN;
+bool table_full = false; // Whether we already warned about a full table
+int num_threads = 0;
+int batch_size = 16; // Max requests a thread takes from the ring per wakeup
+bool pin_threads = false; // Pin server thread i to the i-th CPU we may run on
+struct wal wal;
+bool use_wal = false; // Log PUTs, and only complete them once they're written
+size_t shm_size = 0; // Size of the shared memory region, bounds MGET/MPUT arrays
+struct stats_page *stats; // Live counters, in the region if the client made room for them
+bool use_hot_cache = false; // Threads cache the hottest keys they read
+struct hot_versions hot_versions;
+static __thread struct hot_cache *hot_cache = NULL; // The calling thread's, if it has one
+struct value_heap *heap = NULL; // Values are handles of blobs in here, if the client set one up
+static __thread struct retire_list retired; // Blobs the calling thread's PUTs replaced
+char heap_file[] = "heap_file";
+int max_clients = 0; // We own the region and clients attach to it, if > 0
+uint64_t client_area = CLIENT_AREA_KIB << 10; // Bytes of each client slot's area
+struct client_table *clients = NULL; // Slots of the attached clients, if we own the region
+int shm_fd = -1; // Multi-client: holds our lock on the client table, and probes the clients'
+/* Multi-client: polls each server thread started plus those it finished (odd
+ * while it polls), so the reaper knows when nobody is in a dead client's ring */
+struct __attribute__((aligned(64))) poll_count {
+    uint64_t n;
+} polls[MAX_THREADS];
+/* Multi-client: set while a server thread takes requests off a slot's ring,
+ * so any thread can serve any slot but each ring has one consumer at a time */
+struct __attribute__((aligned(64))) slot_consumer {
+    uint32_t busy;
+} slot_consumers[CLIENT_MAX];
+static __thread uint64_t *my_polls = NULL;
+/* Set once the main thread is done serving, so it can free the tables: a
+ * server thread sets its busy flag before it touches them, then checks
+ * stopping - see enter_tables() and stop_threads() */
+bool stopping = false;
+struct __attribute__((aligned(64))) busy_flag {
+    uint32_t busy;
+} busy[MAX_THREADS];
+static __thread uint32_t *my_busy = NULL;
+//pthread_t threads[MAX_THREADS];
+char shm_file[] = "shmem_file";
 
 /**
- * A hashtable structure that uses chaining to handle collisions.
- * Each bucket is protected by a mutex lock.
+ * Per-thread arguments for the server threads.
 */
-struct kv_store {
-    int size;
-	struct keyvalue_node **v_head; // Key-value pairs, using a linked list/stack for each index
-    pthread_mutex_t **v_locks; // Locks, one for each index
+struct thread_args {
+    int tid;
+    void *mem; // Start of the shared memory region
 };
 
-struct kv_store hashtable;
-int num_threads = 0;
-//pthread_t threads[MAX_THREADS];
-char shm_file[] = "shmem_file";
+struct thread_args thread_args[MAX_THREADS];
+
+/* Tell the user (once) that we're dropping keys */
+static void warn_table_full() {
+    if (!table_full) {
+        table_full = true;
+        fprintf(stderr, "ERROR: hashtable is full, dropping new keys (use a larger -s).\n");
+    }
+}
 
 /**
- * Initialize the hashtable structure.
- * @param size the number of indeces of the hashtable.
- * @return 0 on success.
+ * put() a handle: the blob it replaces goes to the garbage, once no
+ * client can still be reading it.
 */
-int init_kv_store(int size) {
-    hashtable.size = size;
-    hashtable.v_head = malloc(sizeof(struct value_node*) * size);
-    hashtable.v_locks = malloc(sizeof(pthread_mutex_t*) * size);
-    for (int i = 0; i < size; i++) {
-        hashtable.v_head[i] = NULL; // No nodes at start
-        hashtable.v_locks[i] = malloc(sizeof(pthread_mutex_t));
-        pthread_mutex_init(hashtable.v_locks[i], NULL);
+static int put_blob(struct kv_store *store, key_type k, uint32_t handle) {
+    if (!heap_valid(heap, handle)) {
+        printf("ERROR: invalid value handle %u detected by server.\n", handle);
+        return -1;
+    }
+    value_type old;
+    if (exchange(store, k, handle, &old) < 0) {
+        warn_table_full();
+        old = handle; // Nobody will ever read it
     }
+    // Before the blob goes to the garbage, so no hot cache can hand its
+    // handle to a request that started after it was retired
+    if (use_hot_cache)
+        hot_invalidate(&hot_versions, k);
+    if (old != 0)
+        heap_retire(heap, &retired, old);
     return 0;
 }
 
 /**
- * Free the linked list of key-value pair nodes.
- * @param list a pointer to the head node of the linked list.
- * @return 0 on success.
+ * Put n pairs and, with a log, log them - under their stripes, so the log
+ * has every key's puts in the order the table applied them. The completion
+ * is then the log's to write.
+ * @return 0 on success, -1 on an invalid value handle.
 */
-int free_linked_list(struct keyvalue_node *list) {
-    while (list != NULL) {
-        struct keyvalue_node *temp = list;
-        list = list->next;
-        temp->k = 0;
-        temp->v = 0;
-        temp->next = NULL;
-        free(temp);
+static int put_pairs(struct kv_store *store, struct kv_pair *pairs, int n,
+                     struct buffer_descriptor *result, struct buffer_descriptor *bd) {
+    uint64_t held = use_wal ? wal_lock_keys(&wal, pairs, n) : 0;
+    int rc = 0;
+    if (heap != NULL) {
+        for (int i = 0; i < n && rc == 0; i++)
+            rc = put_blob(store, pairs[i].k, pairs[i].v);
     }
-    return 0;
+    else if (n == 1) {
+        if (put(store, pairs[0].k, pairs[0].v) < 0)
+            warn_table_full();
+    }
+    else if (put_multi(store, pairs, n) > 0)
+        warn_table_full();
+    if (use_hot_cache && heap == NULL) { // put_blob() does its own
+        for (int i = 0; i < n; i++)
+            hot_invalidate(&hot_versions, pairs[i].k);
+    }
+    if (use_wal) {
+        if (rc == 0)
+            wal_append(&wal, pairs, n, result, bd);
+        wal_unlock_keys(&wal, held);
+    }
+    return rc;
 }
 
 /**
- * Free the elements in the hashtable structure.
- * @return 0 on success.
+ * Execute a request and write its completion to the client's status board.
+ * @param mem the start of the shared memory region.
+ * @param store the table to execute it on.
+ * @param bd the request, turned into its result.
+ * @return 0 on success, -1 on an invalid request type.
 */
-int free_kv_store() {
-    for (int i = 0; i < hashtable.size; i++) {
-        free_linked_list(hashtable.v_head[i]);
-        hashtable.v_head[i] = NULL;
-        pthread_mutex_destroy(hashtable.v_locks[i]);
-        free(hashtable.v_locks[i]);
-        hashtable.v_locks[i] = NULL;
-    }
-    free(hashtable.v_head);
-    hashtable.v_head = NULL;
-    free(hashtable.v_locks);
-    hashtable.v_locks = NULL;
+int handle_request(void *mem, struct kv_store *store, struct buffer_descriptor *bd) {
+    struct buffer_descriptor *result = (struct buffer_descriptor*) (mem + bd->res_off);
+    if (bd->req_type < STATS_REQ_TYPES)
+        STAT_INC(requests[bd->req_type]);
+    if (bd->req_type == PUT) {
+        STAT_INC(keys);
+        struct kv_pair pair = {bd->k, bd->v};
+        if (put_pairs(store, &pair, 1, result, bd) < 0)
+            return -1;
+        if (use_wal)
+            return 0;
+    }
+    else if (bd->req_type == GET) {
+        STAT_INC(keys);
+        uint32_t version;
+        if (hot_cache == NULL)
+            bd->v = get(store, bd->k);
+        else if (hot_lookup(hot_cache, bd->k, &bd->v, &version))
+            STAT_INC(hot_hits);
+        else {
+            bd->v = get(store, bd->k);
+            hot_fill(hot_cache, bd->k, bd->v, version);
+        }
+    }
+    else if (bd->req_type == MGET || bd->req_type == MPUT) {
+        // Here k is the number of pairs at arg_off
+        if (bd->k > MULTI_MAX || bd->arg_off < 0 ||
+            (size_t) bd->arg_off + bd->k * sizeof(struct kv_pair) > shm_size) {
+            printf("ERROR: invalid multi-key request (%u pairs at offset %d) detected by server.\n",
+                   bd->k, bd->arg_off);
+            return -1;
+        }
+        struct kv_pair *pairs = (struct kv_pair*) (mem + bd->arg_off);
+        STAT_ADD(keys, bd->k);
+        if (bd->req_type == MGET)
+            get_multi(store, pairs, bd->k);
+        else {
+            if (put_pairs(store, pairs, bd->k, result, bd) < 0)
+                return -1;
+            if (use_wal)
+                return 0;
+        }
+    }
+    else if (bd->req_type == SCAN) {
+        // A partition only holds the keys that hash to it
+        if (((struct ring*) mem)->num_partitions > 0) {
+            printf("ERROR: scan request to a partitioned server detected by server.\n");
+            return -1;
+        }
+        // Here v is the most pairs to write to arg_off
+        if (bd->v > MULTI_MAX || bd->arg_off < 0 ||
+            (size_t) bd->arg_off + bd->v * sizeof(struct kv_pair) > shm_size) {
+            printf("ERROR: invalid scan request (%u pairs at offset %d) detected by server.\n",
+                   bd->v, bd->arg_off);
+            return -1;
+        }
+        bd->v = kv_scan(store, bd->k, (struct kv_pair*) (mem + bd->arg_off), bd->v);
+        STAT_ADD(keys, bd->v);
+    }
+    else if (bd->req_type == ADD || bd->req_type == CAS || bd->req_type == SWAP) {
+        // Values are handles, there's nothing to add - and the old blob
+        // would go to the client and the garbage at once
+        if (heap != NULL) {
+            printf("ERROR: read-modify-write request with a value heap detected by server.\n");
+            return -1;
+        }
+        STAT_INC(keys);
+        enum kv_op op = bd->req_type == ADD ? KV_ADD : bd->req_type == CAS ? KV_CAS : KV_SET;
+        // Under the key's stripe from the update to the log, like a PUT
+        struct kv_pair pair = {bd->k, 0};
+        uint64_t held = use_wal ? wal_lock_keys(&wal, &pair, 1) : 0;
+        value_type old = 0;
+        bool done = update(store, bd->k, op, bd->v, bd->cmp, &old) == 0;
+        if (done) {
+            // What update() stored, which only depends on what it found
+            pair.v = kv_apply(op, old, bd->v, bd->cmp);
+            bd->v = old;
+        }
+        else {
+            warn_table_full();
+            bd->req_type = FAILED;
+        }
+        if (use_hot_cache)
+            hot_invalidate(&hot_versions, bd->k);
+        if (use_wal) {
+            // Logged as a put of what it left - nothing if it failed or
+            // left the value unchanged
+            wal_append(&wal, &pair, done && (pair.v != old || op == KV_SET), result, bd);
+            wal_unlock_keys(&wal, held);
+            return 0;
+        }
+    }
+    else {
+        printf("ERROR: invalid request type detected by server.\n");
+        return -1;
+    }
+    complete_request(result, bd);
     return 0;
 }
 
 /**
- * Put the key-value pair into the hashtable, or replace the value if the key
- * is already present. Since chaining with linked lists is used, resizing is
- * unnecessary.
- * @param k the key.
- * @param v the value.
+ * Multi-client: handle a request from the client in slot. An invalid one
+ * completes as FAILED - one client mustn't take a server thread (and every
+ * other client) down with it, nor make it write outside its own area - or,
+ * if even its result is outside the area, is dropped.
 */
-void put(key_type k, value_type v) {
-    int index = hash_function(k, hashtable.size);
-    bool found_key = false;
-    pthread_mutex_lock(hashtable.v_locks[index]);
-    for (struct keyvalue_node *this_node = hashtable.v_head[index]; this_node != NULL; this_node = this_node->next) {
-        if (this_node->k == k) {
-            this_node->v = v;
-            found_key = true;
-            break;
-        }
+static void serve_client(void *mem, int slot, struct buffer_descriptor *bd) {
+    if (client_request_ok(clients, slot, bd)) {
+        if (handle_request(mem, &hashtable, bd) == 0)
+            return;
     }
-    if (!found_key) {
-        struct keyvalue_node *new_node = malloc(sizeof(struct keyvalue_node));
-        new_node->k = k;
-        new_node->v = v;
-        new_node->next = hashtable.v_head[index];
-        hashtable.v_head[index] = new_node; // Functions like a stack
+    else
+        printf("ERROR: request outside the area of client slot %d detected by server.\n", slot);
+    if (client_result_ok(clients, slot, bd)) {
+        bd->req_type = FAILED;
+        complete_request((struct buffer_descriptor*) (mem + bd->res_off), bd);
     }
-    pthread_mutex_unlock(hashtable.v_locks[index]);
-    return;
 }
 
 /**
- * Get the value with the given key from the hashtable.
- * The key-value pair is NOT deleted.
- * @param k the key
- * @return the corresponding value
+ * Poll the given shards once, round-robin starting after the last shard that
+ * had work, handling up to batch_size requests from each. In the
+ * multi-client layout, the shards are the client slots, and only those of
+ * attached clients that no other thread is taking requests from are polled.
+ * @param last index (into shards) of the last shard that had work, updated.
+ * @return the number of requests handled, or -1 on an invalid request.
 */
-value_type get(key_type k) {
-    int index = hash_function(k, hashtable.size);
-    value_type output = 0;
-    for (struct keyvalue_node *this_node = hashtable.v_head[index]; this_node != NULL; this_node = this_node->next) {
-        if (this_node->k == k) {
-            output = this_node->v;
-            break;
+int poll_shards(void *mem, struct ring **shards, int num, int *last, struct buffer_descriptor *bds) {
+    int total = 0;
+    if (my_polls != NULL)
+        __atomic_add_fetch(my_polls, 1, __ATOMIC_SEQ_CST);
+    for (int j = 1; j <= num; j++) {
+        int idx = (*last + j) % num;
+        int slot = shards[idx]->shard_id;
+        if (clients != NULL && (!client_active(clients, slot) || // Free, or its client died
+                                __atomic_exchange_n(&slot_consumers[slot].busy, 1, __ATOMIC_ACQUIRE)))
+            continue; // or another thread is taking its requests
+        int n = ring_try_get_batch(shards[idx], bds, batch_size);
+        if (clients != NULL)
+            __atomic_store_n(&slot_consumers[slot].busy, 0, __ATOMIC_RELEASE);
+        for (int i = 0; i < n; i++) {
+            if (clients != NULL)
+                serve_client(mem, slot, &bds[i]);
+            else if (handle_request(mem, &hashtable, &bds[i]) < 0)
+                return -1;
+        }
+        if (n > 0) {
+            STAT_INC(batches);
+            total += n;
+            *last = idx;
+        }
+    }
+    if (my_polls != NULL)
+        __atomic_add_fetch(my_polls, 1, __ATOMIC_SEQ_CST);
+    return total;
+}
+
+/**
+ * Mark the calling server thread as working on the tables, unless the main
+ * thread is stopping (then it has to exit without touching them).
+ * @return false if we're stopping.
+*/
+static bool enter_tables() {
+    __atomic_store_n(my_busy, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+        return true;
+    __atomic_store_n(my_busy, 0, __ATOMIC_RELEASE);
+    return false;
+}
+
+static void leave_tables() {
+    __atomic_store_n(my_busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Keep the server threads away from the tables from now on: once this
+ * returns, every thread either is asleep on its ring or will see stopping
+ * before it touches them again.
+*/
+static void stop_threads() {
+    __atomic_store_n(&stopping, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < num_threads; i++)
+        while (__atomic_load_n(&busy[i].busy, __ATOMIC_SEQ_CST))
+            cpu_relax();
+}
+
+/**
+ * Server thread for the sharded layout. Thread tid owns shards tid,
+ * tid + num_threads, ... (so it is their only consumer) and polls them;
+ * once they have all stayed empty for as long as the wait strategy allows,
+ * it sleeps on the doorbell. In the multi-client layout, every thread polls
+ * every slot (see slot_consumers), starting from a slot of its own, so the
+ * requests of a single client are spread over all of them.
+*/
+void *shard_thread_function(struct thread_args *ta) {
+    struct ring *r = (struct ring*) ta->mem;
+    struct buffer_descriptor bds[batch_size];
+    struct ring *shards[r->num_shards];
+    int num = 0, last = 0;
+    uint32_t first = clients != NULL ? 0 : ta->tid, step = clients != NULL ? 1 : num_threads;
+    for (uint32_t i = first; i < r->num_shards; i += step)
+        shards[num++] = ring_shard(r, i);
+    if (num == 0)
+        return NULL; // More server threads than shards
+    if (clients != NULL)
+        last = ta->tid % num;
+
+    struct spinner sp = {0};
+    while (true) {
+        if (!enter_tables())
+            return NULL;
+        int n = poll_shards(ta->mem, shards, num, &last, bds);
+        leave_tables();
+        if (n < 0)
+            return (void*) -1;
+        if (n > 0) {
+            spin_done(&sp);
+            sp = (struct spinner) {0};
+            continue;
         }
+        if (!spin_or_sleep(&sp))
+            continue;
+
+        uint32_t bell = doorbell_arm(r);
+        if (!enter_tables())
+            return NULL;
+        n = poll_shards(ta->mem, shards, num, &last, bds);
+        leave_tables();
+        if (n == 0)
+            STAT_INC(empty_waits);
+        doorbell_wait(r, bell, n == 0);
+        if (n < 0)
+            return (void*) -1;
     }
-    return output;
+}
+
+/* wal_replay() callback - put a logged pair back where it belongs
+ * @param arg the main ring */
+static void replay_put(void *arg, key_type k, value_type v) {
+    struct ring *r = arg;
+    struct kv_store *store = &hashtable;
+    if (r->num_partitions > 0)
+        store = &partitions[key_partition(k, r->num_partitions)];
+    if (put(store, k, v) < 0)
+        warn_table_full();
 }
 
 void *thread_function(void *arg) {
-    struct ring *r = (struct ring*) arg;
-    struct buffer_descriptor bd;
+    struct thread_args *ta = (struct thread_args*) arg;
+    struct ring *r = (struct ring*) ta->mem;
+    if (pin_threads)
+        pin_thread(ta->tid, false);
+    my_stats = &stats->threads[ta->tid];
+    my_busy = &busy[ta->tid].busy;
+    if (clients != NULL)
+        my_polls = &polls[ta->tid].n;
+    struct hot_cache cache;
+    if (use_hot_cache) {
+        hot_cache_init(&cache, &hot_versions);
+        hot_cache = &cache;
+    }
+    if (r->num_shards > 0)
+        return shard_thread_function(ta);
+
+    // Partitioned, we're the only consumer of our ring and user of our table
+    struct kv_store *store = &hashtable;
+    if (r->num_partitions > 0) {
+        store = &partitions[ta->tid];
+        r = ring_partition(r, ta->tid);
+    }
+
+    struct buffer_descriptor bds[batch_size];
     while (true) {
-        ring_get(r, &bd);
-        struct buffer_descriptor *result = (struct buffer_descriptor*) (arg + bd.res_off);
-        memcpy(result, &bd, sizeof(struct buffer_descriptor));
-        if (bd.req_type == PUT) {
-            put(bd.k, bd.v);
+        // Only go for the (maybe blocking) get once we know the ring is empty
+        int n = ring_try_get_batch(r, bds, batch_size);
+        if (n == 0) {
+            STAT_INC(empty_waits);
+            n = ring_get_batch(r, bds, batch_size);
         }
-        else if (bd.req_type == GET) {
-            result->v = get(bd.k);
+        STAT_INC(batches);
+        if (!enter_tables())
+            return NULL;
+        for (int i = 0; i < n; i++) {
+            if (handle_request(ta->mem, store, &bds[i]) < 0) {
+                leave_tables();
+                return (void*) -1;
+            }
         }
-        else {
-            printf("ERROR: invalid request type detected by server.\n");
-            return (void*) -1;
+        leave_tables();
+    }
+}
+
+/**
+ * Multi-client: wait until every server thread that was polling when we
+ * started has finished that poll - whatever it polls next, it sees the
+ * slot states we set before.
+*/
+static void wait_for_polls() {
+    uint64_t seen[num_threads];
+    for (int i = 0; i < num_threads; i++)
+        seen[i] = __atomic_load_n(&polls[i].n, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < num_threads; i++) {
+        while (seen[i] % 2 == 1 && __atomic_load_n(&polls[i].n, __ATOMIC_SEQ_CST) == seen[i])
+            usleep(100);
+    }
+}
+
+/**
+ * Multi-client: every REAP_INTERVAL_MS, find the slots whose client died
+ * without detaching, and put them back in service once no server thread
+ * (nor the log's flusher) can still write to them.
+ * @param arg the main ring.
+*/
+static void *reaper_function(void *arg) {
+    struct ring *r = arg;
+    while (true) {
+        usleep(REAP_INTERVAL_MS * 1000);
+        for (uint32_t i = 0; i < clients->max_clients; i++) {
+            int pid;
+            if (!client_reap(r, shm_fd, i, &pid))
+                continue;
+            wait_for_polls();
+            if (use_wal)
+                wal_wait_completed(&wal);
+            client_reset(r, i);
+            fprintf(stderr, "Reclaimed client slot %u: process %d died without detaching\n", i, pid);
         }
-        result->ready = 1;
     }
+    return NULL;
+}
+
+/**
+ * Map the shared memory region the client laid out.
+ * @return the region, NULL on error.
+*/
+static void *map_client_region() {
+    int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    // Get the file size
+    struct stat statbuf;
+    fstat(fd, &statbuf);
+    shm_size = statbuf.st_size;
+
+    // Get a pointer to the shared mmap memory
+    void *mem = mmap(NULL, statbuf.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    // mmap dups the fd, no longer needed
+    close(fd);
+    if (mem == (void*) -1) {
+        perror("mmap");
+        return NULL;
+    }
+    return mem;
+}
+
+/**
+ * Multi-client: create the shared memory region ourselves, with a slot for
+ * each of max_clients clients, and take the client table's lock.
+ * @return the region, NULL on error.
+*/
+static void *create_client_region() {
+    int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    // Don't pull the region from under another server
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct ring)) {
+        struct ring *old = mmap(NULL, sizeof(struct ring), PROT_READ, MAP_SHARED, fd, 0);
+        bool served = old != (void*) -1 && old->clients_off > 0 &&
+                      old->clients_off + sizeof(struct client_table) <= (uint64_t) st.st_size &&
+                      client_table_served(old, fd);
+        if (old != (void*) -1)
+            munmap(old, sizeof(struct ring));
+        if (served) {
+            printf("ERROR: another server is serving clients in %s.\n", shm_file);
+            return NULL;
+        }
+    }
+
+    // Start from zeroes - clients of an earlier server may still have the
+    // old region mapped, but they'll find it cut short
+    uint64_t size = client_region_size(max_clients, client_area, num_threads);
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        return NULL;
+    }
+    void *mem = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == (void*) -1) {
+        perror("mmap");
+        return NULL;
+    }
+    if (init_client_region(mem, max_clients, client_area, num_threads) < 0 ||
+        client_table_own(mem, fd) < 0) {
+        printf("ERROR: could not set up the client slots.\n");
+        return NULL;
+    }
+    shm_fd = fd; // Kept open, closing it would drop our lock
+    shm_size = size;
+    clients = client_table(mem);
+    return mem;
 }
 
 int main(int argc, char *argv[]) {
     int n = 0, s = 0;
+    char *wal_path = NULL;
+    char *snap_path = NULL;
+    int snap_period = 0; // Seconds between snapshots, 0 for SIGUSR1 only
+    enum wal_sync wal_sync = WAL_SYNC_ALWAYS;
+    int wal_interval_ms = 0;
+    double cap_mib = 0; // Memory cap of the table, 0 for none
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-n") == 0) {
             n = atoi(argv[++i]);
@@ -167,36 +574,257 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[i], "-s") == 0) {
             s = atoi(argv[++i]);
         }
+        else if (strcmp(argv[i], "-e") == 0) {
+            if (parse_engine(argv[++i], &engine) < 0) {
+                printf("ERROR: unknown table engine %s (use chain, bucket or skiplist).\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0) {
+            enum wait_strategy ws;
+            if (parse_wait_strategy(argv[++i], &ws) < 0) {
+                printf("ERROR: unknown wait strategy %s (use spin, adaptive or block).\n", argv[i]);
+                return 1;
+            }
+            set_wait_strategy(ws);
+        }
+        else if (strcmp(argv[i], "-l") == 0) {
+            wal_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-y") == 0) {
+            if (parse_wal_sync(argv[++i], &wal_sync, &wal_interval_ms) < 0) {
+                printf("ERROR: unknown sync policy %s (use always, never or a number of ms).\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0) {
+            snap_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0) {
+            snap_period = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            pin_threads = true;
+        }
+        else if (strcmp(argv[i], "-k") == 0) {
+            use_hot_cache = true;
+        }
+        else if (strcmp(argv[i], "-m") == 0) {
+            cap_mib = atof(argv[++i]);
+            if (cap_mib <= 0) {
+                printf("ERROR: the memory cap must be a positive number of MiB.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-M") == 0) {
+            unsigned long kib = CLIENT_AREA_KIB;
+            if (sscanf(argv[++i], "%d:%lu", &max_clients, &kib) < 1 || max_clients < 1 ||
+                max_clients > CLIENT_MAX || kib < 1 || kib > (INT_MAX >> 10)) {
+                printf("ERROR: use -M clients[:area_kib], with 1 to %d clients.\n", CLIENT_MAX);
+                return 1;
+            }
+            client_area = (uint64_t) kib << 10;
+        }
+        else if (strcmp(argv[i], "-b") == 0) {
+            batch_size = atoi(argv[++i]);
+            if (batch_size < 1 || batch_size > MAX_BATCH) {
+                printf("ERROR: batch size must be between 1 and %d.\n", MAX_BATCH);
+                return 1;
+            }
+        }
     }
 
-    init_kv_store(s);
+    if (n < 1 || n > MAX_THREADS) {
+        printf("ERROR: number of threads must be between 1 and %d.\n", MAX_THREADS);
+        return 1;
+    }
+    num_threads = n;
+    // Offsets into the region are ints in a descriptor
+    if (max_clients > 0 && client_region_size(max_clients, client_area, num_threads) > INT_MAX) {
+        printf("ERROR: %d client areas of %lu KiB don't fit in 2 GiB.\n",
+               max_clients, (unsigned long) (client_area >> 10));
+        return 1;
+    }
 
-	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	if (fd < 0)
-		perror("open");
+    void *mem = max_clients > 0 ? create_client_region() : map_client_region();
+    if (mem == NULL)
+        return 1;
 
-    // Get the file size
-    struct stat statbuf;
-    fstat(fd, &statbuf);
+    // Partitioned, each thread gets a table of its own for its share of the keys
+    struct ring *r = (struct ring*) mem;
+    uint64_t wal_from = 0; // Log position the table already covers
+    if (snap_path != NULL && r->num_partitions > 0) {
+        printf("ERROR: snapshots can't be used with a partitioned server.\n");
+        return 1;
+    }
+    int snap_rc = snap_path != NULL ? snapshot_load(&hashtable, snap_path, &wal_from) : 1;
+    if (snap_rc < 0)
+        return 1;
+    if (snap_rc == 0) {
+        engine = hashtable.engine; // Whatever -e said
+        fprintf(stderr, "Loaded %lu keys from the snapshot %s\n", hashtable.count, snap_path);
+    }
+    else if (r->num_partitions > 0) {
+        if (r->num_partitions != (uint32_t) n) {
+            printf("ERROR: the client set up %u partitions for %d server threads.\n", r->num_partitions, n);
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (init_kv_store(&partitions[i], engine, (s + n - 1) / n) < 0) {
+                printf("ERROR: could not allocate the hashtable.\n");
+                return 1;
+            }
+            kv_set_exclusive(&partitions[i]);
+        }
+    }
+    else if (init_kv_store(&hashtable, engine, s) < 0) {
+        printf("ERROR: could not allocate the hashtable.\n");
+        return 1;
+    }
 
-    // Get a pointer to the shared mmap memory
-	void *mem = mmap(NULL, statbuf.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-	if (mem == (void*) -1)
-		perror("mmap");
+    // Values are handles into the client's value heap
+    if (r->heap_size > 0) {
+        if (wal_path != NULL || snap_path != NULL) {
+            printf("ERROR: a log or a snapshot can't be used with a value heap.\n");
+            return 1;
+        }
+        int hfd = open(heap_file, O_RDWR);
+        struct stat hst;
+        if (hfd < 0 || fstat(hfd, &hst) != 0 || (uint64_t) hst.st_size < r->heap_size) {
+            printf("ERROR: could not open the value heap %s.\n", heap_file);
+            return 1;
+        }
+        heap = mmap(NULL, r->heap_size, PROT_WRITE | PROT_READ, MAP_SHARED, hfd, 0);
+        close(hfd);
+        if (heap == (void*) -1 || heap->magic != HEAP_MAGIC || heap->size != r->heap_size) {
+            printf("ERROR: %s is not a value heap.\n", heap_file);
+            return 1;
+        }
+    }
+
+    // A partition's keys are only ever read by the thread that owns them,
+    // there's nothing to win from caching them
+    if (r->num_partitions > 0)
+        use_hot_cache = false;
+    if (use_hot_cache && init_hot_versions(&hot_versions, HOT_VERSION_BITS) < 0) {
+        printf("ERROR: could not allocate the hot key versions.\n");
+        return 1;
+    }
+
+    // Capped, the table evicts keys behind our back - a cached value or a
+    // blob would outlive its key
+    if (cap_mib > 0) {
+        if (use_hot_cache || heap != NULL) {
+            printf("ERROR: a memory cap can't be used with the hot key cache or a value heap.\n");
+            return 1;
+        }
+        uint64_t cap = cap_mib * (1 << 20);
+        bool capped = true;
+        if (r->num_partitions > 0) {
+            for (int i = 0; i < n; i++)
+                capped = capped && kv_set_mem_cap(&partitions[i], cap / n) == 0;
+        }
+        else
+            capped = kv_set_mem_cap(&hashtable, cap) == 0;
+        if (!capped) {
+            printf("ERROR: a memory cap needs the chain engine, and room for the table of -s indices.\n");
+            return 1;
+        }
+    }
+
+    // SIGINT/SIGTERM/SIGUSR1 are left to the main thread (block them before
+    // starting any threads, so they inherit that)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Rebuild the table from the log before serving anything
+    if (wal_path != NULL) {
+        if (wal_open(&wal, wal_path, wal_sync, wal_interval_ms) < 0)
+            return 1;
+        long replayed = wal_replay(&wal, wal_from, &replay_put, r);
+        if (replayed < 0 || wal_start(&wal) < 0) {
+            printf("ERROR: could not recover from the log %s.\n", wal_path);
+            return 1;
+        }
+        fprintf(stderr, "Replayed %ld puts from %s\n", replayed, wal_path);
+        use_wal = true;
+    }
 
-	// mmap dups the fd, no longer needed
-	close(fd);
+    // Publish the counters where kvstat can see them, if the client made room
+    if (r->stats_off > 0 && r->stats_threads >= (uint32_t) n && r->stats_off % 64 == 0 &&
+        r->stats_off + stats_page_size(r->stats_threads) <= shm_size &&
+        ((struct stats_page*) (mem + r->stats_off))->magic == STATS_MAGIC) {
+        stats = (struct stats_page*) (mem + r->stats_off);
+        memset(stats->threads, 0, n * sizeof(struct thread_stats));
+    }
+    else {
+        stats = aligned_alloc(64, stats_page_size(n));
+        if (stats == NULL) {
+            printf("ERROR: could not allocate the statistics.\n");
+            return 1;
+        }
+        memset(stats, 0, stats_page_size(n));
+        stats->magic = STATS_MAGIC;
+        stats->num_threads = n;
+    }
 
     // Create threads, fetch requests from ring buffer, update client request completion status
+
     pthread_t threads[n];
     for (int i = 0; i < n; ++i) {
-        pthread_create(&threads[i], NULL, &thread_function, mem);
+        thread_args[i].tid = i;
+        thread_args[i].mem = mem;
+        pthread_create(&threads[i], NULL, &thread_function, &thread_args[i]);
     }
-    for (int i = 0; i < n; ++i) {
-        pthread_join(threads[i], NULL); // Prevent main thread from freeing the hashtable early
+    pthread_t reaper;
+    if (clients != NULL) {
+        pthread_create(&reaper, NULL, &reaper_function, r);
+        fprintf(stderr, "Serving up to %d clients in %s\n", max_clients, shm_file);
     }
 
-    // Free memory at the end (unused)
-    free_kv_store();
+    // The threads serve until we're told to stop, taking snapshots on
+    // SIGUSR1 (and every snap_period seconds) meanwhile
+    struct timespec period = {snap_period, 0};
+    while (true) {
+        int sig;
+        if (snap_path != NULL && snap_period > 0)
+            sig = sigtimedwait(&signals, NULL, &period);
+        else
+            sigwait(&signals, &sig);
+        if (sig < 0 && errno != EAGAIN)
+            continue; // Interrupted
+        if (sig == SIGINT || sig == SIGTERM)
+            break;
+        if (snap_path == NULL)
+            continue;
+        uint64_t wal_offset = use_wal ? wal_position(&wal) : 0;
+        if (snapshot_write(&hashtable, snap_path, wal_offset) == 0)
+            fprintf(stderr, "Wrote the snapshot %s\n", snap_path);
+    }
+    if (r->num_partitions > 0) {
+        for (int i = 0; i < n; i++) {
+            fprintf(stderr, "partition %d: ", i);
+            kv_print_stats(&partitions[i], stderr);
+        }
+    }
+    else
+        kv_print_stats(&hashtable, stderr);
+    if (use_wal)
+        wal_print_stats(&wal, stderr);
+    if (heap != NULL)
+        heap_print_stats(heap, stderr);
+
+    // Threads asleep on their rings stay there, nobody is left to wake them
+    stop_threads();
+    if (r->num_partitions > 0) {
+        for (int i = 0; i < n; i++)
+            free_kv_store(&partitions[i]);
+    }
+    else
+        free_kv_store(&hashtable);
     return 0;
 }
@@ -0,0 +1,769 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "kv_table.h"
+#include "stats.h"
+
+int parse_engine(const char *name, enum kv_engine *engine) {
+    if (strcmp(name, "chain") == 0)
+        *engine = ENGINE_CHAIN;
+    else if (strcmp(name, "bucket") == 0)
+        *engine = ENGINE_BUCKET;
+    else if (strcmp(name, "skiplist") == 0)
+        *engine = ENGINE_SKIPLIST;
+    else
+        return -1;
+    return 0;
+}
+
+/* Bytes a chain_table of size indices takes */
+static inline uint64_t chain_table_bytes(uint32_t size) {
+    return sizeof(struct chain_table) + (uint64_t) size * sizeof(struct chain_bucket);
+}
+
+/**
+ * Allocate an array of chains.
+ * @param size the number of indeces of the table.
+ * @return the table, NULL if the allocation failed.
+*/
+static struct chain_table *alloc_chain_table(uint32_t size) {
+    struct chain_table *t = malloc(sizeof(struct chain_table));
+    if (t == NULL)
+        return NULL;
+    t->size = size;
+    t->next = t->retired = NULL;
+    t->migrate_next = t->migrated = 0;
+    t->buckets = aligned_alloc(64, sizeof(struct chain_bucket) * size);
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        t->buckets[i].version = 0;
+        t->buckets[i].moved = 0;
+        t->buckets[i].head = NULL; // No nodes at start
+        t->buckets[i].ref = 0;
+        pthread_mutex_init(&t->buckets[i].lock, NULL);
+    }
+    return t;
+}
+
+/**
+ * Initialize the chained hashtable.
+ * @param size the initial number of indeces of the hashtable.
+ * @return 0 on success.
+*/
+static int init_chain(struct kv_store *s, int size) {
+    s->size = size;
+    s->old = NULL;
+    s->count = 0;
+    s->mem_cap = 0;
+    s->evictions = 0;
+    s->clock_hand = 0;
+    pthread_mutex_init(&s->resize_lock, NULL);
+    slab_init(&s->nodes, sizeof(struct keyvalue_node));
+    s->table = alloc_chain_table(table_size_for(size > 0 ? size : 1));
+    if (s->table == NULL)
+        return -1;
+    s->table_bytes = chain_table_bytes(s->table->size);
+    return 0;
+}
+
+int init_kv_store(struct kv_store *s, enum kv_engine engine, int size) {
+    s->engine = engine;
+    s->exclusive = false;
+    if (engine == ENGINE_BUCKET) {
+        s->size = size;
+        return init_bucket_table(&s->bt, size);
+    }
+    if (engine == ENGINE_SKIPLIST) {
+        s->size = size;
+        s->count = 0;
+        s->sl = malloc(sizeof(struct skiplist));
+        if (s->sl == NULL || init_skiplist(s->sl) < 0) {
+            free(s->sl);
+            return -1;
+        }
+        return 0;
+    }
+    return init_chain(s, size);
+}
+
+int kv_set_mem_cap(struct kv_store *s, uint64_t bytes) {
+    if (bytes > 0 && (s->engine != ENGINE_CHAIN || kv_mem_bytes(s) > bytes))
+        return -1;
+    s->mem_cap = bytes;
+    return 0;
+}
+
+void kv_set_exclusive(struct kv_store *s) {
+    s->exclusive = true;
+    s->bt.exclusive = true;
+}
+
+/**
+ * Free a table. Its nodes belong to the store's slab, which releases them
+ * all at once.
+*/
+static void free_chain_table(struct chain_table *t) {
+    for (uint32_t i = 0; i < t->size; i++) {
+        t->buckets[i].head = NULL;
+        pthread_mutex_destroy(&t->buckets[i].lock);
+    }
+    free(t->buckets);
+    free(t);
+}
+
+int free_kv_store(struct kv_store *s) {
+    if (s->engine == ENGINE_BUCKET) {
+        free_bucket_table(&s->bt);
+        return 0;
+    }
+    if (s->engine == ENGINE_SKIPLIST) {
+        free_skiplist(s->sl);
+        free(s->sl);
+        s->sl = NULL;
+        return 0;
+    }
+    // Retired tables are only kept for readers that may still be walking them
+    struct chain_table *t = s->table->retired;
+    while (t != NULL) {
+        struct chain_table *temp = t;
+        t = t->retired;
+        free_chain_table(temp);
+    }
+    if (s->old != NULL)
+        free_chain_table(s->old);
+    free_chain_table(s->table);
+    s->table = s->old = NULL;
+    slab_destroy(&s->nodes);
+    pthread_mutex_destroy(&s->resize_lock);
+    return 0;
+}
+
+/* Lock a bucket's mutex, counting it if somebody else holds it */
+static inline void chain_lock(struct chain_bucket *b) {
+    if (pthread_mutex_trylock(&b->lock) != 0) {
+        STAT_INC(lock_contended);
+        pthread_mutex_lock(&b->lock);
+    }
+}
+
+/* Writer side of the bucket's seqlock - call with the bucket's mutex held */
+static inline void chain_write_begin(struct chain_bucket *b) {
+    __atomic_store_n(&b->version, b->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // Odd version before any change
+}
+
+static inline void chain_write_end(struct chain_bucket *b) {
+    __atomic_store_n(&b->version, b->version + 1, __ATOMIC_RELEASE);
+}
+
+static inline struct chain_bucket *chain_bucket_of(struct chain_table *t, key_type k) {
+    return &t->buckets[hash_function(k, t->size)];
+}
+
+uint64_t kv_mem_bytes(struct kv_store *s) {
+    return __atomic_load_n(&s->table_bytes, __ATOMIC_RELAXED) +
+           __atomic_load_n(&s->count, __ATOMIC_RELAXED) * s->nodes.obj_size;
+}
+
+/* Whether a table of size indices still fits under the cap next to the
+ * ones we have */
+static inline bool chain_can_grow(struct kv_store *s, uint32_t size) {
+    return s->mem_cap == 0 || kv_mem_bytes(s) + chain_table_bytes(size) <= s->mem_cap;
+}
+
+/* k's reference bit in its bucket's ref - keys of a chain share a bit now
+ * and then, which only gives one of them a second chance it didn't earn */
+static inline uint64_t chain_ref_bit(key_type k) {
+    return 1ull << (hash_murmur(k) & 63);
+}
+
+/* Set k's reference bit, if it isn't already - most gets then only read ref */
+static inline void chain_touch(struct chain_bucket *b, key_type k) {
+    uint64_t bit = chain_ref_bit(k);
+    if ((__atomic_load_n(&b->ref, __ATOMIC_RELAXED) & bit) == 0)
+        __atomic_fetch_or(&b->ref, bit, __ATOMIC_RELAXED);
+}
+
+/**
+ * Move the chain of an old index to its new indices. The caller holds the
+ * old bucket's mutex; we lock each new bucket while pushing a node onto it
+ * (always old before new, so this can't deadlock with put()).
+ * @return true if we moved it, false if somebody else already had.
+*/
+static bool migrate_bucket(struct chain_table *old, struct chain_bucket *ob) {
+    if (ob->moved)
+        return false;
+    chain_write_begin(ob);
+    struct keyvalue_node *node = ob->head;
+    while (node != NULL) {
+        struct keyvalue_node *next = node->next;
+        struct chain_bucket *nb = chain_bucket_of(old->next, node->k);
+        chain_lock(nb);
+        chain_write_begin(nb);
+        __atomic_store_n(&node->next, nb->head, __ATOMIC_RELAXED);
+        __atomic_store_n(&nb->head, node, __ATOMIC_RELEASE);
+        chain_write_end(nb);
+        pthread_mutex_unlock(&nb->lock);
+        node = next;
+    }
+    __atomic_store_n(&ob->head, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&ob->moved, 1, __ATOMIC_RELAXED);
+    chain_write_end(ob);
+    return true;
+}
+
+/**
+ * Count one more moved index of the old table, and end the resize if that
+ * was the last one. The old table is retired rather than freed, since
+ * lock-free readers may still be looking at it.
+*/
+static void finish_migrate(struct kv_store *s, struct chain_table *old) {
+    if (__atomic_add_fetch(&old->migrated, 1, __ATOMIC_ACQ_REL) < old->size)
+        return;
+    pthread_mutex_lock(&s->resize_lock);
+    old->retired = old->next->retired;
+    old->next->retired = old;
+    __atomic_store_n(&s->old, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->resize_lock);
+}
+
+/* Move an index of the old table, unless somebody already has */
+static void migrate_index(struct kv_store *s, struct chain_table *old, struct chain_bucket *ob) {
+    chain_lock(ob);
+    bool moved = migrate_bucket(old, ob);
+    pthread_mutex_unlock(&ob->lock);
+    if (moved)
+        finish_migrate(s, old);
+}
+
+/* Move the next CHAIN_MIGRATE_STEP indices of the old table nobody has claimed yet */
+static void migrate_step(struct kv_store *s, struct chain_table *old) {
+    for (int i = 0; i < CHAIN_MIGRATE_STEP; i++) {
+        uint32_t idx = __atomic_fetch_add(&old->migrate_next, 1, __ATOMIC_RELAXED);
+        if (idx >= old->size)
+            break;
+        migrate_index(s, old, &old->buckets[idx]);
+    }
+}
+
+/**
+ * Move the old index k hashes to (so k only has to be looked for in the new
+ * table), plus the next CHAIN_MIGRATE_STEP indices nobody has claimed yet.
+*/
+static void help_migrate(struct kv_store *s, struct chain_table *old, key_type k) {
+    migrate_index(s, old, chain_bucket_of(old, k));
+    migrate_step(s, old);
+}
+
+/**
+ * Start doubling the number of indices if the chains got too long and no
+ * resize is running. old is published before the new table, so a reader
+ * that loads table and then old sees old whenever it sees the new table.
+*/
+static void maybe_start_resize(struct kv_store *s) {
+    struct chain_table *cur = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->count, __ATOMIC_RELAXED) <= (uint64_t) cur->size * CHAIN_MAX_LOAD ||
+        __atomic_load_n(&s->old, __ATOMIC_RELAXED) != NULL || !chain_can_grow(s, cur->size * 2))
+        return;
+    if (pthread_mutex_trylock(&s->resize_lock) != 0)
+        return;
+    if (s->old == NULL && s->table == cur) {
+        struct chain_table *t = alloc_chain_table(cur->size * 2);
+        if (t != NULL) {
+            // The old table is retired, not freed, so it keeps counting
+            __atomic_add_fetch(&s->table_bytes, chain_table_bytes(t->size), __ATOMIC_RELAXED);
+            t->retired = cur->retired;
+            cur->retired = NULL;
+            cur->next = t;
+            __atomic_store_n(&s->old, cur, __ATOMIC_RELEASE);
+            __atomic_store_n(&s->table, t, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&s->resize_lock);
+}
+
+/**
+ * Evict the keys of a chain whose reference bits aren't set, and clear the
+ * bits - the caller holds the bucket's mutex (unless the store is
+ * exclusive). Readers walking the chain see the version change and walk it
+ * again, and a node they still hold stays mapped in the slab.
+*/
+static void chain_sweep(struct kv_store *s, struct chain_bucket *b) {
+    uint64_t ref = __atomic_exchange_n(&b->ref, 0, __ATOMIC_RELAXED);
+    if (b->head == NULL)
+        return;
+    uint64_t evicted = 0;
+    chain_write_begin(b);
+    struct keyvalue_node **link = &b->head;
+    while (*link != NULL) {
+        struct keyvalue_node *node = *link;
+        if (ref & chain_ref_bit(node->k)) {
+            link = &node->next; // Second chance
+            continue;
+        }
+        __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+        slab_free(&s->nodes, node);
+        evicted++;
+    }
+    chain_write_end(b);
+    if (evicted > 0) {
+        __atomic_sub_fetch(&s->count, evicted, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->evictions, evicted, __ATOMIC_RELAXED);
+        STAT_ADD(evictions, evicted);
+    }
+}
+
+/**
+ * Move the clock hand over the indices of the table, sweeping each, until
+ * we're back under the cap. Threads going over the cap together each take
+ * their own indices. A resize in progress is helped along first, since the
+ * hand only sweeps the new table.
+*/
+static void chain_evict(struct kv_store *s) {
+    uint64_t swept = 0;
+    while (kv_mem_bytes(s) > s->mem_cap) {
+        struct chain_table *cur = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+        struct chain_table *old = __atomic_load_n(&s->old, __ATOMIC_ACQUIRE);
+        if (swept++ > (uint64_t) cur->size * CHAIN_EVICT_TURNS)
+            return; // Gets keep setting the bits faster than we clear them
+        uint32_t idx = __atomic_fetch_add(&s->clock_hand, 1, __ATOMIC_RELAXED) % cur->size;
+        if (old != NULL)
+            migrate_step(s, old);
+        struct chain_bucket *b = &cur->buckets[idx];
+        if (s->exclusive) {
+            chain_sweep(s, b);
+            continue;
+        }
+        chain_lock(b);
+        if (!b->moved)
+            chain_sweep(s, b);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+/**
+ * Update the value of k in the chained hashtable, under its index's lock.
+ * During a resize, the key's old index is moved over first so the key only
+ * exists in the new table, and we move a few more indices while we're at it.
+*/
+static int chain_update(struct kv_store *s, key_type k, enum kv_op op, value_type v, value_type cmp,
+                        value_type *old) {
+    struct chain_bucket *b;
+    while (true) {
+        // Load table before old - see maybe_start_resize()
+        struct chain_table *cur = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+        struct chain_table *old_table = __atomic_load_n(&s->old, __ATOMIC_ACQUIRE);
+        if (old_table != NULL)
+            help_migrate(s, old_table, k);
+        b = chain_bucket_of(cur, k);
+        chain_lock(b);
+        if (!b->moved)
+            break;
+        // A resize moved this chain since we loaded cur, try the newer table
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    bool found_key = false;
+    int len = 0;
+    chain_write_begin(b);
+    for (struct keyvalue_node *this_node = b->head; this_node != NULL; this_node = this_node->next) {
+        len++;
+        if (this_node->k == k) {
+            if (old != NULL)
+                *old = this_node->v;
+            __atomic_store_n(&this_node->v, kv_apply(op, this_node->v, v, cmp), __ATOMIC_RELAXED);
+            found_key = true;
+            break;
+        }
+    }
+    if (!found_key && old != NULL)
+        *old = 0;
+    bool insert = !found_key && kv_inserts(op, v, cmp);
+    struct keyvalue_node *new_node = NULL;
+    if (insert && (new_node = slab_alloc(&s->nodes)) != NULL) {
+        new_node->k = k;
+        new_node->v = kv_apply(op, 0, v, cmp);
+        new_node->next = b->head;
+        __atomic_store_n(&b->head, new_node, __ATOMIC_RELEASE); // Functions like a stack
+        // A new key gets its second chance, or the sweep this put may
+        // start could evict it right away
+        if (s->mem_cap > 0)
+            chain_touch(b, k);
+    }
+    chain_write_end(b);
+    pthread_mutex_unlock(&b->lock);
+    STAT_INC(chain_len[stats_len_bucket(len)]);
+
+    if (insert) {
+        if (new_node == NULL)
+            return -1;
+        __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+        maybe_start_resize(s);
+        if (s->mem_cap > 0)
+            chain_evict(s);
+    }
+    return 0;
+}
+
+/**
+ * Double the number of indices of an exclusive store in one go - nobody
+ * else can be looking at the old table, so it's freed right away.
+*/
+static void chain_rehash(struct kv_store *s) {
+    struct chain_table *cur = s->table;
+    struct chain_table *t = alloc_chain_table(cur->size * 2);
+    if (t == NULL)
+        return; // Keep going with longer chains
+    for (uint32_t i = 0; i < cur->size; i++) {
+        struct keyvalue_node *node = cur->buckets[i].head;
+        while (node != NULL) {
+            struct keyvalue_node *next = node->next;
+            struct chain_bucket *nb = chain_bucket_of(t, node->k);
+            node->next = nb->head;
+            nb->head = node;
+            node = next;
+        }
+    }
+    t->retired = cur->retired;
+    s->table_bytes += chain_table_bytes(t->size) - chain_table_bytes(cur->size);
+    free_chain_table(cur);
+    s->table = t;
+}
+
+/**
+ * chain_update() for an exclusive store - no locks, no seqlock, no migration.
+*/
+static int chain_update_exclusive(struct kv_store *s, key_type k, enum kv_op op, value_type v,
+                                  value_type cmp, value_type *old) {
+    struct chain_bucket *b = chain_bucket_of(s->table, k);
+    int len = 0;
+    if (old != NULL)
+        *old = 0;
+    for (struct keyvalue_node *this_node = b->head; this_node != NULL; this_node = this_node->next) {
+        len++;
+        if (this_node->k == k) {
+            if (old != NULL)
+                *old = this_node->v;
+            this_node->v = kv_apply(op, this_node->v, v, cmp);
+            STAT_INC(chain_len[stats_len_bucket(len)]);
+            return 0;
+        }
+    }
+    STAT_INC(chain_len[stats_len_bucket(len)]);
+    if (!kv_inserts(op, v, cmp))
+        return 0;
+    struct keyvalue_node *new_node = slab_alloc(&s->nodes);
+    if (new_node == NULL)
+        return -1;
+    new_node->k = k;
+    new_node->v = kv_apply(op, 0, v, cmp);
+    new_node->next = b->head;
+    b->head = new_node;
+    if (s->mem_cap > 0)
+        chain_touch(b, k);
+    // Rehashing needs both tables at once
+    if (++s->count > (uint64_t) s->table->size * CHAIN_MAX_LOAD && chain_can_grow(s, s->table->size * 2))
+        chain_rehash(s);
+    if (s->mem_cap > 0)
+        chain_evict(s);
+    return 0;
+}
+
+/**
+ * chain_get() for an exclusive store.
+*/
+static value_type chain_get_exclusive(struct kv_store *s, key_type k) {
+    int len = 0;
+    struct chain_bucket *b = chain_bucket_of(s->table, k);
+    for (struct keyvalue_node *this_node = b->head; this_node != NULL; this_node = this_node->next) {
+        len++;
+        if (this_node->k == k) {
+            STAT_INC(chain_len[stats_len_bucket(len)]);
+            if (s->mem_cap > 0)
+                chain_touch(b, k);
+            return this_node->v;
+        }
+    }
+    STAT_INC(chain_len[stats_len_bucket(len)]);
+    return 0;
+}
+
+/**
+ * Look for k in one chain, without locking. The chain is walked again if a
+ * writer changed the bucket meanwhile, so we never return a value torn by a
+ * concurrent put.
+ * @param touch whether to set k's reference bit if we find it.
+ * @param moved set if the chain has been moved to the next table.
+ * @param len set to the number of nodes we walked.
+ * @return the value, 0 if k isn't in the chain.
+*/
+static value_type chain_lookup(struct chain_bucket *b, key_type k, bool touch, bool *moved, int *len) {
+    value_type output;
+    uint32_t ver;
+    while (true) {
+        ver = __atomic_load_n(&b->version, __ATOMIC_ACQUIRE);
+        if (ver & 1) { // A writer is in the middle of changing the chain
+            sched_yield();
+            continue;
+        }
+        output = 0;
+        *moved = __atomic_load_n(&b->moved, __ATOMIC_RELAXED);
+        int steps = 0;
+        for (struct keyvalue_node *this_node = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+             this_node != NULL; this_node = __atomic_load_n(&this_node->next, __ATOMIC_RELAXED)) {
+            steps++;
+            if (__atomic_load_n(&this_node->k, __ATOMIC_RELAXED) == k) {
+                output = __atomic_load_n(&this_node->v, __ATOMIC_RELAXED);
+                break;
+            }
+            // Nodes may be relinked under us - don't follow them for long
+            if (steps % 64 == 0 && __atomic_load_n(&b->version, __ATOMIC_ACQUIRE) != ver)
+                break;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&b->version, __ATOMIC_RELAXED) == ver) {
+            *len = steps;
+            if (touch && output != 0)
+                chain_touch(b, k);
+            return output;
+        }
+    }
+}
+
+/**
+ * Get the value with the given key from the chained hashtable. During a
+ * resize, the key is in the old table until its index there is moved.
+*/
+static value_type chain_get(struct kv_store *s, key_type k) {
+    bool moved, touch = s->mem_cap > 0;
+    int len, total = 0;
+    while (true) {
+        // Load table before old - see maybe_start_resize()
+        struct chain_table *cur = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+        struct chain_table *old = __atomic_load_n(&s->old, __ATOMIC_ACQUIRE);
+        if (old != NULL && old != cur) {
+            value_type v = chain_lookup(chain_bucket_of(old, k), k, touch, &moved, &len);
+            total += len;
+            if (!moved) {
+                STAT_INC(chain_len[stats_len_bucket(total)]);
+                return v;
+            }
+        }
+        value_type v = chain_lookup(chain_bucket_of(cur, k), k, touch, &moved, &len);
+        total += len;
+        if (!moved) {
+            STAT_INC(chain_len[stats_len_bucket(total)]);
+            return v;
+        }
+        // cur itself got resized since we loaded it
+    }
+}
+
+/* update() for ENGINE_SKIPLIST */
+static int skiplist_update_count(struct kv_store *s, key_type k, enum kv_op op, value_type v,
+                                 value_type cmp, value_type *old) {
+    int rc = skiplist_update(s->sl, k, op, v, cmp, old);
+    if (rc > 0)
+        __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+    return rc < 0 ? -1 : 0;
+}
+
+int update(struct kv_store *s, key_type k, enum kv_op op, value_type v, value_type cmp, value_type *old) {
+    if (s->engine == ENGINE_BUCKET)
+        return bucket_update(&s->bt, k, op, v, cmp, old);
+    if (s->engine == ENGINE_SKIPLIST)
+        return skiplist_update_count(s, k, op, v, cmp, old);
+    if (s->exclusive)
+        return chain_update_exclusive(s, k, op, v, cmp, old);
+    return chain_update(s, k, op, v, cmp, old);
+}
+
+int exchange(struct kv_store *s, key_type k, value_type v, value_type *old) {
+    return update(s, k, KV_SET, v, 0, old);
+}
+
+int put(struct kv_store *s, key_type k, value_type v) {
+    return exchange(s, k, v, NULL);
+}
+
+value_type get(struct kv_store *s, key_type k) {
+    if (s->engine == ENGINE_BUCKET)
+        return bucket_get(&s->bt, k);
+    if (s->engine == ENGINE_SKIPLIST)
+        return skiplist_get(s->sl, k);
+    if (s->exclusive)
+        return chain_get_exclusive(s, k);
+    return chain_get(s, k);
+}
+
+/**
+ * Start loading the cache line of the index k hashes to (the chain_bucket,
+ * or the bucket table's bucket) - the node chains aren't prefetched, their
+ * addresses are only known once the index is loaded. The table may be
+ * resized by the time we use it, which only costs us the prefetch.
+*/
+static void prefetch_key(struct kv_store *s, key_type k) {
+    if (s->engine == ENGINE_BUCKET) {
+        bucket_prefetch(&s->bt, k);
+        return;
+    }
+    if (s->engine == ENGINE_SKIPLIST)
+        return; // Where k is depends on every node on the way there
+    struct chain_table *cur = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+    __builtin_prefetch(chain_bucket_of(cur, k));
+}
+
+void get_multi(struct kv_store *s, struct kv_pair *pairs, int n) {
+    for (int i = 0; i < n && i < KV_PREFETCH_DIST; i++)
+        prefetch_key(s, pairs[i].k);
+    for (int i = 0; i < n; i++) {
+        if (i + KV_PREFETCH_DIST < n)
+            prefetch_key(s, pairs[i + KV_PREFETCH_DIST].k);
+        pairs[i].v = get(s, pairs[i].k);
+    }
+}
+
+int put_multi(struct kv_store *s, struct kv_pair *pairs, int n) {
+    int failed = 0;
+    for (int i = 0; i < n && i < KV_PREFETCH_DIST; i++)
+        prefetch_key(s, pairs[i].k);
+    for (int i = 0; i < n; i++) {
+        if (i + KV_PREFETCH_DIST < n)
+            prefetch_key(s, pairs[i + KV_PREFETCH_DIST].k);
+        if (put(s, pairs[i].k, pairs[i].v) < 0)
+            failed++;
+    }
+    return failed;
+}
+
+/* Call fn on every pair of a chain table, holding each index's mutex */
+static void chain_for_each(struct chain_table *t, void (*fn)(void *arg, key_type k, value_type v), void *arg) {
+    for (uint32_t i = 0; i < t->size; i++) {
+        struct chain_bucket *b = &t->buckets[i];
+        chain_lock(b);
+        for (struct keyvalue_node *node = b->head; node != NULL; node = node->next)
+            fn(arg, node->k, node->v);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+void kv_for_each(struct kv_store *s, void (*fn)(void *arg, key_type k, value_type v), void *arg) {
+    if (s->engine == ENGINE_SKIPLIST) {
+        skiplist_for_each(s->sl, fn, arg);
+        return;
+    }
+    if (s->engine == ENGINE_BUCKET) {
+        struct kv_bucket b;
+        if (s->bt.zero_val != 0)
+            fn(arg, 0, __atomic_load_n(&s->bt.zero_val, __ATOMIC_RELAXED));
+        for (uint32_t i = 0; i < s->bt.num_buckets; i++) {
+            bucket_copy(&s->bt, i, &b);
+            for (int j = 0; j < BUCKET_SLOTS; j++)
+                if (b.keys[j] != 0)
+                    fn(arg, b.keys[j], b.vals[j]);
+        }
+        return;
+    }
+    // Holding resize_lock, no resize can start (or finish), so the tables
+    // stay the same. A running one moves pairs from old to table, so walk
+    // old first - a pair we haven't seen there yet will be in table.
+    pthread_mutex_lock(&s->resize_lock);
+    struct chain_table *old = __atomic_load_n(&s->old, __ATOMIC_ACQUIRE);
+    if (old != NULL)
+        chain_for_each(old, fn, arg);
+    chain_for_each(__atomic_load_n(&s->table, __ATOMIC_ACQUIRE), fn, arg);
+    pthread_mutex_unlock(&s->resize_lock);
+}
+
+/**
+ * The n smallest keys >= start seen so far, as a max-heap on the key so the
+ * largest one is the first to go.
+*/
+struct scan_heap {
+    key_type start;
+    struct kv_pair *pairs;
+    int len, cap;
+};
+
+static void heap_sift_down(struct kv_pair *h, int len, int i) {
+    while (true) {
+        int max = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < len && h[l].k > h[max].k)
+            max = l;
+        if (r < len && h[r].k > h[max].k)
+            max = r;
+        if (max == i)
+            return;
+        struct kv_pair tmp = h[i];
+        h[i] = h[max];
+        h[max] = tmp;
+        i = max;
+    }
+}
+
+/* kv_for_each() callback of kv_scan() on a hash engine */
+static void scan_offer(void *arg, key_type k, value_type v) {
+    struct scan_heap *sh = arg;
+    if (k < sh->start || (sh->len == sh->cap && k >= sh->pairs[0].k))
+        return;
+    // A pair being moved by a resize may be seen twice
+    for (int i = 0; i < sh->len; i++)
+        if (sh->pairs[i].k == k)
+            return;
+    if (sh->len < sh->cap) {
+        int i = sh->len++;
+        sh->pairs[i] = (struct kv_pair) {k, v};
+        while (i > 0 && sh->pairs[(i - 1) / 2].k < sh->pairs[i].k) {
+            struct kv_pair tmp = sh->pairs[i];
+            sh->pairs[i] = sh->pairs[(i - 1) / 2];
+            sh->pairs[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    sh->pairs[0] = (struct kv_pair) {k, v};
+    heap_sift_down(sh->pairs, sh->len, 0);
+}
+
+int kv_scan(struct kv_store *s, key_type start, struct kv_pair *pairs, int n) {
+    if (s->engine == ENGINE_SKIPLIST)
+        return skiplist_scan(s->sl, start, pairs, n);
+    if (n <= 0)
+        return 0;
+    // Hashing scatters the keys, so every pair has to be looked at
+    struct scan_heap sh = {start, pairs, 0, n};
+    kv_for_each(s, &scan_offer, &sh);
+    // Heap sort - popping the largest key to the end each time
+    for (int len = sh.len - 1; len > 0; len--) {
+        struct kv_pair tmp = pairs[0];
+        pairs[0] = pairs[len];
+        pairs[len] = tmp;
+        heap_sift_down(pairs, len, 0);
+    }
+    return sh.len;
+}
+
+void kv_print_stats(struct kv_store *s, FILE *f) {
+    if (s->engine == ENGINE_SKIPLIST) {
+        fprintf(f, "skiplist: %lu keys\n", __atomic_load_n(&s->count, __ATOMIC_RELAXED));
+        skiplist_print_stats(s->sl, f);
+        return;
+    }
+    if (s->engine == ENGINE_BUCKET) {
+        fprintf(f, "bucket table: %u buckets (%.1f MiB)\n", s->bt.num_buckets,
+                (double) s->bt.num_buckets * sizeof(struct kv_bucket) / (1 << 20));
+        return;
+    }
+    struct chain_table *t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+    fprintf(f, "chain table: %lu keys, %u indices\n",
+            __atomic_load_n(&s->count, __ATOMIC_RELAXED), t->size);
+    if (s->mem_cap > 0)
+        fprintf(f, "chain table: %.1f of %.1f MiB, %lu keys evicted\n", (double) kv_mem_bytes(s) / (1 << 20),
+                (double) s->mem_cap / (1 << 20), __atomic_load_n(&s->evictions, __ATOMIC_RELAXED));
+    slab_print_stats(&s->nodes, "keyvalue_node", f);
+}
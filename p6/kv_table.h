@@ -0,0 +1,207 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "common.h"
+#include "bucket_table.h"
+#include "skiplist.h"
+#include "slab.h"
+
+/**
+ * Table engines the server can keep its key-value pairs in.
+*/
+enum kv_engine {
+    ENGINE_CHAIN = 0, // Chaining with a linked list per index (default)
+    ENGINE_BUCKET,    // Linear probing over cache-line sized buckets
+    ENGINE_SKIPLIST   // Ordered - a lock-free skiplist, for fast scans
+};
+
+/**
+ * A linked list node representing a key-value pair.
+*/
+struct keyvalue_node {
+    key_type k;
+    value_type v;
+    struct keyvalue_node *next;
+};
+
+/**
+ * One index of the chained hashtable, padded to a cache line. Writers hold
+ * the mutex and make the version odd while they change the chain; readers
+ * take no lock and walk the chain again if the version changed under them.
+*/
+struct __attribute__((aligned(64))) chain_bucket {
+    uint32_t version;
+    uint32_t moved; // Set once a resize moved this chain to the next table
+    struct keyvalue_node *head; // Key-value pairs, using a linked list/stack
+    pthread_mutex_t lock;
+    uint64_t ref; // CLOCK reference bits of the chain's keys, one per key hash - see kv_set_mem_cap()
+};
+
+/* Average chain length that triggers doubling the number of indices */
+#define CHAIN_MAX_LOAD 2
+
+/* Number of old indices each put() moves to the new table during a resize */
+#define CHAIN_MIGRATE_STEP 8
+
+/* Full turns of the clock an eviction makes before giving up - after one,
+ * every key it passed has lost its reference bit */
+#define CHAIN_EVICT_TURNS 2
+
+/**
+ * An array of chains. During a resize, there are two of these - the old one
+ * is moved over to next a few indices at a time, and a key lives in the old
+ * table until its index there has been moved.
+*/
+struct chain_table {
+    uint32_t size;
+    struct chain_bucket *buckets; // One for each index
+    struct chain_table *next; // Table we're resizing into
+    struct chain_table *retired; // Older tables, freed with the store
+    uint32_t migrate_next; // Next index to move into next
+    uint32_t migrated; // Number of indices that have been moved
+};
+
+/**
+ * A hashtable structure. With ENGINE_CHAIN, it uses chaining to handle
+ * collisions and each bucket is protected by a mutex lock; with
+ * ENGINE_BUCKET, the pairs live in bt instead, and with ENGINE_SKIPLIST,
+ * in sl.
+*/
+struct kv_store {
+    enum kv_engine engine;
+    int size;
+    struct chain_table *table; // Where new keys go
+    struct chain_table *old; // Table being moved into table, NULL if not resizing
+    pthread_mutex_t resize_lock; // Held while starting a resize
+    struct slab nodes; // Where the keyvalue_nodes come from
+    struct bucket_table bt;
+    struct skiplist *sl;
+    bool exclusive; // Only one thread ever uses the store - see kv_set_exclusive()
+    uint64_t mem_cap; // Bytes the tables and nodes may take, 0 for no limit - see kv_set_mem_cap()
+    uint64_t table_bytes; // Bytes of every chain_table, retired ones included
+    uint64_t __attribute__((aligned(64))) count; // Number of keys
+    uint64_t evictions; // Keys evicted to stay under mem_cap
+    uint32_t __attribute__((aligned(64))) clock_hand; // Next index of table to sweep
+};
+
+/**
+ * Look up a table engine by name ("chain", "bucket" or "skiplist").
+ * @return 0 on success, -1 if there is no such engine.
+*/
+int parse_engine(const char *name, enum kv_engine *engine);
+
+/**
+ * Initialize the hashtable structure.
+ * @param engine the table engine to use.
+ * @param size the number of indeces of the hashtable (ENGINE_CHAIN), or the
+ * number of keys it has to hold (ENGINE_BUCKET) - ENGINE_SKIPLIST ignores it.
+ * @return 0 on success.
+*/
+int init_kv_store(struct kv_store *s, enum kv_engine engine, int size);
+
+/**
+ * Promise that only the calling thread will ever use the store (e.g. one
+ * partition of a partitioned server), so put() and get() can skip every
+ * lock and seqlock, and a resize rehashes the whole table at once.
+*/
+void kv_set_exclusive(struct kv_store *s);
+
+/**
+ * Cap the bytes the chained hashtable takes (its tables, retired ones
+ * included, and its nodes). Once a put goes over the cap, keys are evicted
+ * with CLOCK: a hand sweeps the indices of the table, and evicts every key
+ * of an index whose reference bit isn't set, clearing the bits it finds set.
+ * get() sets the bit of the key it finds, and a put the bit of the key it
+ * inserts, so keys read or added since the hand last passed get a second
+ * chance. A key evicted reads as not present. Evictions aren't logged (see
+ * wal.h), so replaying a log puts evicted keys back, subject to the cap
+ * again. Resizes that would go over the cap aren't started, so chains get
+ * longer instead.
+ * @param bytes the cap, 0 for no limit.
+ * @return 0 on success, -1 if the engine isn't ENGINE_CHAIN or the table
+ * alone already takes more than bytes.
+*/
+int kv_set_mem_cap(struct kv_store *s, uint64_t bytes);
+
+/**
+ * Bytes the tables and nodes of the chained hashtable take.
+*/
+uint64_t kv_mem_bytes(struct kv_store *s);
+
+/**
+ * Free the elements in the hashtable structure.
+ * @return 0 on success.
+*/
+int free_kv_store(struct kv_store *s);
+
+/**
+ * Put the key-value pair into the hashtable, or replace the value if the key
+ * is already present.
+ * @return 0 on success, -1 if the table is full or we're out of memory.
+*/
+int put(struct kv_store *s, key_type k, value_type v);
+
+/**
+ * Get the value with the given key from the hashtable.
+ * The key-value pair is NOT deleted.
+ * @return the corresponding value, 0 if the key is not present.
+*/
+value_type get(struct kv_store *s, key_type k);
+
+/**
+ * put(), also getting the value it replaced - the swap is atomic, so of
+ * concurrent exchanges of a key, each gets a different old value.
+ * @param old set to the value replaced, 0 if the key was not present.
+ * @return 0 on success, -1 if the table is full or we're out of memory.
+*/
+int exchange(struct kv_store *s, key_type k, value_type v, value_type *old);
+
+/**
+ * Read-modify-write the value of k atomically - concurrent updates of a key
+ * each see the value the one before left. A key that isn't present reads as
+ * 0, and is only put if the update leaves something else (or is a KV_SET).
+ * @param old set to the value found, 0 if the key was not present.
+ * @return 0 on success, -1 if the table is full or we're out of memory.
+*/
+int update(struct kv_store *s, key_type k, enum kv_op op, value_type v, value_type cmp, value_type *old);
+
+/* How many keys ahead of the one being looked up get_multi()/put_multi()
+ * prefetch */
+#define KV_PREFETCH_DIST 8
+
+/**
+ * Get the values of n keys, prefetching the indices of the keys a few
+ * lookups ahead so their cache misses overlap.
+ * @param pairs the keys, each v is set to the key's value (0 if not present).
+*/
+void get_multi(struct kv_store *s, struct kv_pair *pairs, int n);
+
+/**
+ * Put n key-value pairs, in order, prefetching like get_multi().
+ * @return the number of pairs that could not be put (table full).
+*/
+int put_multi(struct kv_store *s, struct kv_pair *pairs, int n);
+
+/**
+ * Copy the first n pairs with keys >= start, in key order, to pairs. Only
+ * ENGINE_SKIPLIST finds them without going through the whole store: on the
+ * hash engines every call is an O(table) kv_for_each() - on ENGINE_CHAIN
+ * holding resize_lock throughout - so it is only fit for checking results.
+ * Pairs put meanwhile may or may not be seen.
+ * @return the number of pairs copied.
+*/
+int kv_scan(struct kv_store *s, key_type start, struct kv_pair *pairs, int n);
+
+/**
+ * Call fn(arg, k, v) for every key of the store, while other threads keep
+ * using it. Each index is read consistently, but pairs put meanwhile may or
+ * may not be seen (and a pair being moved by a resize may be seen twice).
+ * Resizes aren't started until we're done.
+*/
+void kv_for_each(struct kv_store *s, void (*fn)(void *arg, key_type k, value_type v), void *arg);
+
+/**
+ * Print statistics about the hashtable's memory.
+*/
+void kv_print_stats(struct kv_store *s, FILE *f);
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ring_buffer.h"
+#include "stats.h"
+
+/*
+ * Prints what a running server is doing, vmstat style: attaches read-only to
+ * the shared memory region and, every interval, prints the rates of the
+ * counters the server threads keep in the region's stats page (see stats.h).
+*/
+
+#define NUM_FIELDS (sizeof(struct thread_stats) / sizeof(uint64_t))
+
+char shm_file[256] = "shmem_file";
+double interval = 1;
+int count = 0; /* 0 for forever */
+int per_thread = 0;
+
+int fd = -1;
+size_t map_len = 0;
+struct stats_page *page = NULL;
+uint32_t num_threads = 0; /* Threads in the page, as checked by attach() */
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Map the region and find its stats page, exits if there isn't one */
+static void attach() {
+	fd = open(shm_file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	map_len = st.st_size;
+	if (map_len < sizeof(struct ring)) {
+		printf("ERROR: %s is too small to hold a ring, is the client running?\n", shm_file);
+		exit(EXIT_FAILURE);
+	}
+	char *mem = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == (void *) -1) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	struct ring *r = (struct ring *) mem;
+	if (r->stats_off == 0 || r->stats_off % 64 != 0 ||
+	    r->stats_off + stats_page_size(r->stats_threads) > map_len) {
+		printf("ERROR: %s has no statistics page.\n", shm_file);
+		exit(EXIT_FAILURE);
+	}
+	page = (struct stats_page *) (mem + r->stats_off);
+	if (page->magic != STATS_MAGIC) {
+		printf("ERROR: bad statistics page magic in %s.\n", shm_file);
+		exit(EXIT_FAILURE);
+	}
+	/* The page only has room for stats_threads threads */
+	num_threads = page->num_threads;
+	if (num_threads > r->stats_threads) {
+		printf("ERROR: statistics page of %s claims %u threads, it has room for %u.\n",
+		       shm_file, num_threads, r->stats_threads);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Copy the counters of every thread - each one is only ever written whole,
+ * but they aren't read at the same instant */
+static void sample(struct thread_stats *dst) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < map_len) {
+		printf("The shared memory region went away.\n");
+		exit(EXIT_SUCCESS);
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		const uint64_t *src = (const uint64_t *) &page->threads[i];
+		uint64_t *out = (uint64_t *) &dst[i];
+		for (size_t j = 0; j < NUM_FIELDS; j++)
+			out[j] = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+	}
+}
+
+/* d = a - b, field by field */
+static void delta(struct thread_stats *d, const struct thread_stats *a, const struct thread_stats *b) {
+	for (size_t j = 0; j < NUM_FIELDS; j++)
+		((uint64_t *) d)[j] = ((const uint64_t *) a)[j] - ((const uint64_t *) b)[j];
+}
+
+static void add(struct thread_stats *d, const struct thread_stats *a) {
+	for (size_t j = 0; j < NUM_FIELDS; j++)
+		((uint64_t *) d)[j] += ((const uint64_t *) a)[j];
+}
+
+static void print_header() {
+	printf("%6s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "thread",
+	       "put/s", "get/s", "mget/s", "mput/s", "rmw/s", "scan/s", "keys/s", "batch/s", "empty/s", "contend/s", "hot/s", "evict/s");
+}
+
+static void print_rates(const char *name, const struct thread_stats *d, double secs) {
+	printf("%6s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", name,
+	       d->requests[PUT] / secs, d->requests[GET] / secs,
+	       d->requests[MGET] / secs, d->requests[MPUT] / secs,
+	       (d->requests[ADD] + d->requests[CAS] + d->requests[SWAP]) / secs,
+	       d->requests[SCAN] / secs,
+	       d->keys / secs, d->batches / secs, d->empty_waits / secs, d->lock_contended / secs,
+	       d->hot_hits / secs, d->evictions / secs);
+}
+
+/* Share of the lookups in each length bucket, skipped if there were none */
+static void print_lengths(const char *name, const uint64_t *lens) {
+	static const char *labels[STATS_LEN_BUCKETS] = {"0", "1", "2", "3", "4-7", "8-15", "16-31", "32+"};
+	uint64_t total = 0;
+	for (int i = 0; i < STATS_LEN_BUCKETS; i++)
+		total += lens[i];
+	if (total == 0)
+		return;
+	printf("%13s", name);
+	for (int i = 0; i < STATS_LEN_BUCKETS; i++)
+		if (lens[i] > 0)
+			printf("  %s:%.1f%%", labels[i], 100.0 * lens[i] / total);
+	printf("\n");
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-f shm_file] [-i interval] [-c count] [-t]\n", name);
+	printf("-f shared memory file of the running server (default: %s)\n", shm_file);
+	printf("-i seconds between reports (default: %.0f)\n", interval);
+	printf("-c number of reports, 0 to run until interrupted (default: %d)\n", count);
+	printf("-t also report each server thread\n");
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hf:i:c:t")) != -1) {
+		switch (op) {
+		case 'f':
+		strncpy(shm_file, optarg, sizeof(shm_file) - 1);
+		break;
+
+		case 'i':
+		interval = atof(optarg);
+		break;
+
+		case 'c':
+		count = atoi(optarg);
+		break;
+
+		case 't':
+		per_thread = 1;
+		break;
+
+		case 'h':
+		usage(argv[0]);
+		return 0;
+
+		default:
+		usage(argv[0]);
+		return 1;
+		}
+	}
+	if (interval <= 0 || count < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	attach();
+	uint32_t n = num_threads;
+	struct thread_stats *prev = calloc(n, sizeof(struct thread_stats));
+	struct thread_stats *cur = calloc(n, sizeof(struct thread_stats));
+	if (prev == NULL || cur == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	sample(prev);
+	double last = now();
+	for (int reports = 0; count == 0 || reports < count; reports++) {
+		usleep(interval * 1e6);
+		sample(cur);
+		double t = now();
+		double secs = t - last;
+
+		struct thread_stats total, d;
+		memset(&total, 0, sizeof(total));
+		if (reports % 20 == 0 || per_thread)
+			print_header();
+		for (uint32_t i = 0; i < n; i++) {
+			delta(&d, &cur[i], &prev[i]);
+			add(&total, &d);
+			if (per_thread) {
+				char name[16];
+				snprintf(name, sizeof(name), "%u", i);
+				print_rates(name, &d, secs);
+			}
+		}
+		print_rates("all", &total, secs);
+		print_lengths("chain length", total.chain_len);
+		print_lengths("probe length", total.probe_len);
+		fflush(stdout);
+
+		struct thread_stats *tmp = prev;
+		prev = cur;
+		cur = tmp;
+		last = t;
+	}
+	return 0;
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "common.h"
+#include "ring_buffer.h"
+
+/*
+ * Moves descriptors through the rings alone - no table, no completions -
+ * to tell a ring regression from a table one. Producers submit num_items
+ * descriptors each, consumers take them off in batches, and we report how
+ * many went through per second, for each ring layout:
+ * lockfree - one shared ring, every producer and consumer on it (the
+ *            default layout)
+ * sem      - the same, with the semaphore + mutex ring (client -R sem)
+ * spsc     - one RING_SPSC shard per producer, consumer j polling shards
+ *            j, j + c, ... (the layout of client -S)
+ * mpsc     - one RING_MPSC ring per consumer, each producer spreading its
+ *            items over them (the layout of the client slots of -M)
+*/
+
+#define REPEAT 5
+#define MAX_THREADS 128
+
+int num_producers = 1;
+int num_consumers = 1;
+int num_items = 1 << 20;
+int batch = 1;
+int repeat = REPEAT;
+int pin = 0;
+int csv = 0;
+const char *layout = NULL; /* NULL: all of them */
+
+struct ring *rings; /* The main ring, then its shards */
+int num_rings; /* Rings behind the main one, 0 for shared */
+enum ring_mode mode;
+uint64_t __attribute__((aligned(64))) consumed;
+uint64_t total;
+
+static void *producer(void *arg) {
+	int tid = (int) (long) arg;
+	if (pin)
+		pin_thread(tid, false);
+	struct buffer_descriptor bds[MULTI_MAX];
+	memset(bds, 0, sizeof(bds));
+	for (int i = 0; i < num_items; i += batch) {
+		int n = num_items - i < batch ? num_items - i : batch;
+		for (int j = 0; j < n; j++) {
+			bds[j].req_type = GET;
+			bds[j].k = i + j;
+		}
+		struct ring *r = rings;
+		if (num_rings > 0)
+			r = ring_shard(rings, mode == RING_SPSC ? tid : (i / batch) % num_rings);
+		ring_submit_batch(r, bds, n);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	int tid = (int) (long) arg;
+	if (pin)
+		pin_thread(num_producers + tid, false);
+	struct buffer_descriptor bds[MULTI_MAX];
+	/* Rings of this consumer: tid, tid + c, ... (just the main one if shared) */
+	int first = num_rings > 0 ? tid : 0, step = num_consumers;
+	if (num_rings > 0 && first >= num_rings)
+		return NULL; /* More consumers than shards */
+	int next = first;
+	struct spinner sp = {0};
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total) {
+		struct ring *r = num_rings > 0 ? ring_shard(rings, next) : rings;
+		int n = ring_try_get_batch(r, bds, MULTI_MAX);
+		if (num_rings > 0 && (next += step) >= num_rings)
+			next = first;
+		if (n > 0) {
+			__atomic_add_fetch(&consumed, n, __ATOMIC_RELAXED);
+			spin_done(&sp);
+			sp = (struct spinner) {0};
+		}
+		/* Out of spins: yield rather than sleep, so we still see the end
+		 * of the run */
+		else if (spin_or_sleep(&sp)) {
+			sched_yield();
+			spin_done(&sp);
+			sp = (struct spinner) {0};
+		}
+	}
+	return NULL;
+}
+
+/* A ring layout: the main ring's mode, and how many rings are behind it */
+struct layout {
+	enum ring_mode m;
+	int shards;
+};
+
+/* One run of a layout, in millions of items per second */
+static double run(void *arg) {
+	enum ring_mode m = ((struct layout *) arg)->m;
+	int shards = ((struct layout *) arg)->shards;
+	mode = m;
+	num_rings = shards;
+	if (init_ring_mode(rings, m == RING_SPSC || m == RING_MPSC ? RING_LOCKFREE : m) < 0 ||
+	    (shards > 0 && (m == RING_SPSC ? init_shards(rings, shards) : init_client_rings(rings, shards)) < 0)) {
+		fprintf(stderr, "ERROR: could not initialize the rings\n");
+		exit(EXIT_FAILURE);
+	}
+	consumed = 0;
+	total = (uint64_t) num_producers * num_items;
+
+	pthread_t threads[2 * MAX_THREADS];
+	struct timespec s, e;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (long i = 0; i < num_consumers; i++)
+		pthread_create(&threads[num_producers + i], NULL, consumer, (void*) i);
+	for (long i = 0; i < num_producers; i++)
+		pthread_create(&threads[i], NULL, producer, (void*) i);
+	for (int i = 0; i < num_producers + num_consumers; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	return total / get_elapsed_ns(&s, &e) * 1e3;
+}
+
+/* Run a layout repeat times (after a warm-up run) and print the median */
+static void bench(const char *name, enum ring_mode m, int shards) {
+	if (layout != NULL && strcmp(layout, name) != 0)
+		return;
+	double mops[REPEAT * 4];
+	struct layout l = {m, shards};
+	double median = bench_repeat(run, &l, repeat, mops);
+	if (csv)
+		printf("ring,%s,%d,%d,%d,%.3f,%.3f,%.3f\n", name, num_producers, num_consumers, batch,
+		       median, mops[0], mops[repeat - 1]);
+	else
+		printf("%-10s %9d %9d %6d | %8.2f %8.2f %8.2f\n", name, num_producers, num_consumers, batch,
+		       median, mops[0], mops[repeat - 1]);
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-p producers] [-c consumers] [-n num_items] [-b batch] [-r repeat] [-l layout] [-A] [-q]\n", name);
+	printf("-h show this help\n");
+	printf("-p number of producer threads (default: %d)\n", num_producers);
+	printf("-c number of consumer threads (default: %d)\n", num_consumers);
+	printf("-n items each producer submits per run (default: %d)\n", num_items);
+	printf("-b items submitted together with ring_submit_batch (default: %d, max %d)\n", batch, MULTI_MAX);
+	printf("-r timed runs of each layout, after one warm-up run (default: %d, max %d)\n", repeat, REPEAT * 4);
+	printf("-l only run one layout: 'lockfree', 'sem', 'spsc' or 'mpsc' (default: all)\n");
+	printf("-A if set, pins the producers, then the consumers, to cores\n");
+	printf("-q if set, prints CSV rows (bench,layout,producers,consumers,batch,median,min,max) without a header\n");
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hp:c:n:b:r:l:Aq")) != -1) {
+		switch (op) {
+		case 'p':
+		num_producers = atoi(optarg);
+		break;
+
+		case 'c':
+		num_consumers = atoi(optarg);
+		break;
+
+		case 'n':
+		num_items = atoi(optarg);
+		break;
+
+		case 'b':
+		batch = atoi(optarg);
+		break;
+
+		case 'r':
+		repeat = atoi(optarg);
+		break;
+
+		case 'l':
+		layout = optarg;
+		break;
+
+		case 'A':
+		pin = 1;
+		break;
+
+		case 'q':
+		csv = 1;
+		break;
+
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+
+		default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+		}
+	}
+	if (num_producers < 1 || num_producers > MAX_THREADS || num_consumers < 1 || num_consumers > MAX_THREADS ||
+	    num_items < 1 || batch < 1 || batch > MULTI_MAX || repeat < 1 || repeat > REPEAT * 4) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Room for the most rings a layout uses */
+	int max_rings = num_producers > num_consumers ? num_producers : num_consumers;
+	rings = mmap(NULL, (1 + max_rings) * sizeof(struct ring), PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rings == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!csv)
+		printf("%-10s %9s %9s %6s | %8s %8s %8s\n", "layout", "producers", "consumers", "batch",
+		       "Mitems/s", "min", "max");
+	bench("lockfree", RING_LOCKFREE, 0);
+	bench("sem", RING_SEM, 0);
+	bench("spsc", RING_SPSC, num_producers);
+	bench("mpsc", RING_MPSC, num_consumers);
+	return 0;
+}
@@ -1,12 +1,63 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
 
 #include "ring_buffer.h"
 
+/*
+ * Wait for the other side of the ring to move past pos, following the
+ * process's wait strategy: spin, or sleep on the other side's head counter
+ * (p_head for consumers, c_head for producers)
+ * @param waiters c_waiters or p_waiters, tells the other side to wake us up
+ * @param head the other side's head counter
+ * @param pos the head value we're waiting to see change
+ * @param sp the caller's state for this wait
+*/
+static void ring_wait(uint32_t *waiters, uint32_t *head, uint32_t pos, struct spinner *sp) {
+    if (!spin_or_sleep(sp))
+        return;
+    /* The other side already claimed the slot and is copying - it can't
+     * take long, so don't go to sleep */
+    if (__atomic_load_n(head, __ATOMIC_ACQUIRE) != pos) {
+        sched_yield();
+        return;
+    }
+    /* The increment must be visible before futex_wait re-checks *head, and the
+     * other side updates *head before reading *waiters - so one of us always
+     * sees the other */
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    futex_wait(head, pos);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wake up to n threads sleeping on our head counter, if there are any */
+static void ring_wake(uint32_t *waiters, uint32_t *head, int n) {
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(head, n);
+}
+
 int init_ring(struct ring *r) {
+    return init_ring_mode(r, RING_LOCKFREE);
+}
+
+int init_ring_mode(struct ring *r, enum ring_mode mode) {
     if (r == NULL) return -1;
+    r->mode = mode;
+    r->num_shards = 0;
+    r->num_partitions = 0;
+    r->stats_off = 0;
+    r->stats_threads = 0;
+    r->heap_size = 0;
+    r->clients_off = 0;
+    r->p_head = r->p_tail = r->c_head = r->c_tail = 0;
+    r->p_waiters = r->c_waiters = 0;
+    for (uint32_t i = 0; i < RING_SIZE; i++)
+        r->seq[i] = i;
     // Initialize semaphores for shared usage
     sem_init(&r->sem_not_full, 1, RING_SIZE);  // Initial value is the size of the ring
     sem_init(&r->sem_not_empty, 1, 0);         // Initial value is 0
@@ -16,22 +67,245 @@ int init_ring(struct ring *r) {
     return 0;
 }
 
-void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
-    if (r == NULL || bd == NULL) return;
+/*
+ * Semaphore submit: take one slot (blocking) plus as many more as are free
+ * right now, so a batch never holds slots while waiting for more
+*/
+static int sem_ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    int k = 1;
     sem_wait(&r->sem_not_full);
+    while (k < n && sem_trywait(&r->sem_not_full) == 0)
+        k++;
     pthread_mutex_lock(&r->s_mutex);
-    r->buffer[r->p_head] = *bd;
-    r->p_head = (r->p_head + 1) % RING_SIZE;
+    for (int i = 0; i < k; i++) {
+        r->buffer[r->p_head] = bds[i];
+        r->p_head = (r->p_head + 1) % RING_SIZE;
+    }
     pthread_mutex_unlock(&r->s_mutex);
-    sem_post(&r->sem_not_empty);
+    for (int i = 0; i < k; i++)
+        sem_post(&r->sem_not_empty);
+    return k;
 }
 
-void ring_get(struct ring *r, struct buffer_descriptor *bd) {
-    if (r == NULL || bd == NULL) return;
-    sem_wait(&r->sem_not_empty);
+static int sem_ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int n, bool block) {
+    int k = 1;
+    if (block)
+        sem_wait(&r->sem_not_empty);
+    else if (sem_trywait(&r->sem_not_empty) != 0)
+        return 0;
+    while (k < n && sem_trywait(&r->sem_not_empty) == 0)
+        k++;
     pthread_mutex_lock(&r->g_mutex);
-    *bd = r->buffer[r->c_tail];
-    r->c_tail = (r->c_tail + 1) % RING_SIZE;
+    for (int i = 0; i < k; i++) {
+        bds[i] = r->buffer[r->c_tail];
+        r->c_tail = (r->c_tail + 1) % RING_SIZE;
+    }
     pthread_mutex_unlock(&r->g_mutex);
-    sem_post(&r->sem_not_full);
+    for (int i = 0; i < k; i++)
+        sem_post(&r->sem_not_full);
+    return k;
+}
+
+/* Count the slots from pos on (up to n) whose sequence number is pos + i + off */
+static int lf_count_ready(struct ring *r, uint32_t pos, uint32_t off, int n) {
+    int k = 0;
+    while (k < n && __atomic_load_n(&r->seq[(pos + k) & RING_MASK], __ATOMIC_ACQUIRE) == pos + k + off)
+        k++;
+    return k;
+}
+
+/* Move a head we've counted k ready slots on - single-sided rings own their
+ * head and can store it, everyone else has to race for it */
+static bool lf_advance(struct ring *r, uint32_t *head, uint32_t *pos, int k) {
+    if (r->mode == RING_SPSC || (r->mode == RING_MPSC && head == &r->c_head)) {
+        __atomic_store_n(head, *pos + k, __ATOMIC_SEQ_CST);
+        return true;
+    }
+    return __atomic_compare_exchange_n(head, pos, *pos + k, true,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* The main ring a shard lives behind - see ring_shard() */
+static struct ring *shard_parent(struct ring *r) {
+    return r - (r->shard_id + 1);
 }
+
+/* Let a server thread sleeping on the doorbell know this shard has work */
+static void shard_ring_bell(struct ring *r) {
+    struct ring *parent = shard_parent(r);
+    /* Our seq stores must be visible before we look for sleepers, pairs
+     * with the re-poll in doorbell_arm()/doorbell_wait() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&parent->bell_waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&parent->bell, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&parent->bell, INT_MAX);
+    }
+}
+
+/*
+ * Lock-free submit: claim the free slots at p_head (up to n of them, each
+ * released by the consumer one lap behind) with a single CAS, copy the
+ * descriptors in, then hand the slots to the consumers by bumping their
+ * sequence numbers.
+ * @return the number of descriptors submitted, at least 1
+*/
+static int lf_ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    uint32_t pos = __atomic_load_n(&r->p_head, __ATOMIC_RELAXED);
+    struct spinner sp = {0};
+    int k;
+    while (true) {
+        k = lf_count_ready(r, pos, 0, n);
+        if (k > 0) {
+            if (lf_advance(r, &r->p_head, &pos, k)) {
+                spin_done(&sp);
+                break;
+            }
+            continue; // pos was reloaded by the failed CAS
+        }
+        uint32_t s = __atomic_load_n(&r->seq[pos & RING_MASK], __ATOMIC_ACQUIRE);
+        if ((int32_t) (s - pos) < 0) // Full - the consumer one lap behind hasn't released this slot yet
+            ring_wait(&r->p_waiters, &r->c_head, pos - RING_SIZE, &sp);
+        pos = __atomic_load_n(&r->p_head, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < k; i++)
+        r->buffer[(pos + i) & RING_MASK] = bds[i];
+    for (int i = 0; i < k; i++)
+        __atomic_store_n(&r->seq[(pos + i) & RING_MASK], pos + i + 1, __ATOMIC_RELEASE);
+    if (r->mode == RING_SPSC || r->mode == RING_MPSC)
+        shard_ring_bell(r);
+    else
+        ring_wake(&r->c_waiters, &r->p_head, k);
+    return k;
+}
+
+/*
+ * Lock-free get: claim the published slots at c_head (up to n of them) with
+ * a single CAS, copy the descriptors out, then release the slots to the
+ * producers one lap ahead.
+ * @param block whether to wait for an item if the ring is empty
+ * @return the number of descriptors copied to bds, 0 only if !block
+*/
+static int lf_ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int n, bool block) {
+    uint32_t pos = __atomic_load_n(&r->c_head, __ATOMIC_RELAXED);
+    struct spinner sp = {0};
+    int k;
+    while (true) {
+        k = lf_count_ready(r, pos, 1, n);
+        if (k > 0) {
+            if (lf_advance(r, &r->c_head, &pos, k)) {
+                spin_done(&sp);
+                break;
+            }
+            continue;
+        }
+        uint32_t s = __atomic_load_n(&r->seq[pos & RING_MASK], __ATOMIC_ACQUIRE);
+        if ((int32_t) (s - (pos + 1)) < 0) { // Empty - nothing published at this position yet
+            if (!block)
+                return 0;
+            ring_wait(&r->c_waiters, &r->p_head, pos, &sp);
+        }
+        pos = __atomic_load_n(&r->c_head, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < k; i++)
+        bds[i] = r->buffer[(pos + i) & RING_MASK];
+    for (int i = 0; i < k; i++)
+        __atomic_store_n(&r->seq[(pos + i) & RING_MASK], pos + i + RING_SIZE, __ATOMIC_RELEASE);
+    ring_wake(&r->p_waiters, &r->c_head, k);
+    return k;
+}
+
+void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
+    ring_submit_batch(r, bd, 1);
+}
+
+void ring_get(struct ring *r, struct buffer_descriptor *bd) {
+    ring_get_batch(r, bd, 1);
+}
+
+void ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    if (r == NULL || bds == NULL) return;
+    while (n > 0) {
+        int k;
+        if (r->mode == RING_SEM)
+            k = sem_ring_submit_batch(r, bds, n);
+        else
+            k = lf_ring_submit_batch(r, bds, n);
+        bds += k;
+        n -= k;
+    }
+}
+
+int ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    if (r == NULL || bds == NULL || n <= 0) return 0;
+    if (r->mode == RING_SEM)
+        return sem_ring_get_batch(r, bds, n, true);
+    else
+        return lf_ring_get_batch(r, bds, n, true);
+}
+
+int ring_try_get_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    if (r == NULL || bds == NULL || n <= 0) return 0;
+    if (r->mode == RING_SEM)
+        return sem_ring_get_batch(r, bds, n, false);
+    else
+        return lf_ring_get_batch(r, bds, n, false);
+}
+
+struct ring *ring_shard(struct ring *r, int i) {
+    return r + i + 1;
+}
+
+static int init_shards_mode(struct ring *r, int n, enum ring_mode mode) {
+    if (r == NULL || n < 0) return -1;
+    r->num_shards = n;
+    r->bell = r->bell_waiters = 0;
+    for (int i = 0; i < n; i++) {
+        struct ring *shard = ring_shard(r, i);
+        int rc = init_ring_mode(shard, mode);
+        if (rc < 0)
+            return rc;
+        shard->shard_id = i;
+    }
+    return 0;
+}
+
+int init_shards(struct ring *r, int n) {
+    return init_shards_mode(r, n, RING_SPSC);
+}
+
+int init_client_rings(struct ring *r, int n) {
+    return init_shards_mode(r, n, RING_MPSC);
+}
+
+struct ring *ring_partition(struct ring *r, int i) {
+    return r + i + 1;
+}
+
+int init_partitions(struct ring *r, int n) {
+    if (r == NULL || n < 0) return -1;
+    r->num_partitions = n;
+    for (int i = 0; i < n; i++) {
+        int rc = init_ring_mode(ring_partition(r, i), r->mode);
+        if (rc < 0)
+            return rc;
+    }
+    return 0;
+}
+
+uint32_t doorbell_arm(struct ring *r) {
+    __atomic_add_fetch(&r->bell_waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->bell, __ATOMIC_SEQ_CST);
+}
+
+void doorbell_wait(struct ring *r, uint32_t seen, bool sleep) {
+    if (sleep)
+        futex_wait(&r->bell, seen);
+    __atomic_sub_fetch(&r->bell_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void complete_request(struct buffer_descriptor *result, struct buffer_descriptor *bd) {
+    memcpy(result, bd, offsetof(struct buffer_descriptor, ready));
+    if (__atomic_exchange_n(&result->ready, COMP_READY, __ATOMIC_SEQ_CST) == COMP_WAITING)
+        futex_wake((uint32_t*) &result->ready, 1);
+}
+
@@ -4,12 +4,41 @@
 #include <stdbool.h>
 #include <semaphore.h>
 #include "common.h"
+#include "wait.h"
 
 #define RING_SIZE 1024
+#define RING_MASK (RING_SIZE - 1)
+
+/* Values of buffer_descriptor.ready */
+#define COMP_NOT_READY 0
+#define COMP_READY 1
+#define COMP_WAITING 2 /* not ready, and the client sleeps on it (futex) */
 
 enum REQUEST_TYPE {
   PUT = 0,
-  GET
+  GET,
+  MGET, /* k keys at arg_off, their values are written back in place */
+  MPUT, /* k key-value pairs at arg_off, put in order */
+  SCAN, /* the first v pairs with keys >= k, in key order, are written to
+         * arg_off - the completion's v is how many there were */
+  /* Read-modify-writes, done atomically by the server - the completion's v
+   * is the value k had before (0 if it wasn't present) */
+  ADD,  /* add v to the value of k */
+  CAS,  /* set k to v if its value is cmp */
+  SWAP, /* set k to v (get-and-set) */
+  FAILED /* only in a completion: the server refused the request */
+};
+
+/* Most pairs a single MGET/MPUT (or SCAN) can carry */
+#define MULTI_MAX 256
+
+/* Synchronization scheme used by a ring - chosen by whoever calls init_ring
+ * and stored in the ring itself, so both processes agree on it */
+enum ring_mode {
+  RING_LOCKFREE = 0, /* per-slot sequence numbers, CAS on p_head/c_head */
+  RING_SEM,          /* semaphores + producer/consumer mutexes (baseline) */
+  RING_SPSC,         /* lock-free, one producer and one consumer (shards) */
+  RING_MPSC          /* lock-free, any producer and one consumer (client slots) */
 };
 
 /* Client sends requests using this format - Each element of the ring is
@@ -18,6 +47,8 @@ struct buffer_descriptor {
         enum REQUEST_TYPE req_type;
         key_type k;
         value_type v;
+        /* CAS only - the value k has to have for v to be put */
+        value_type cmp;
         /* Result offset (in bytes) - this is where the client program expects to see the
          * result of its query - The kv_store program should write the result
          * at this address (assuming shared_mem_start is a char * and points
@@ -25,12 +56,20 @@ struct buffer_descriptor {
          * struct buffer_descriptor *result = shared_mem_start + res_off;
          * memcpy(result, ..., sizeof(struct buffer_descriptor); */
         int res_off;
+        /* MGET/MPUT only - byte offset (from the start of the shared memory
+         * region, like res_off) of an array of k struct kv_pairs. The
+         * server works on the array in place, so it must stay untouched
+         * until the request completes. SCAN writes its v pairs there. */
+        int arg_off;
         /* The client program polls predefined locations for request completions -
          * It considers a request as completed when this flag is set to 1 - So, after
          * doing memcpy above, the kv_store should set the ready flag:
          * result->ready = 1;
          * The client program will reset the flag to 0 before using the same
-         * location for completion */
+         * location for completion
+         * A client thread that goes to sleep waiting for the completion sets
+         * it to COMP_WAITING and futex-waits on it - see complete_request().
+         * This has to stay the last field. */
         int ready;
 };
 
@@ -52,8 +91,44 @@ struct __attribute__((packed, aligned(64))) ring {
         /* Consumer head - next consumer will consume the data pointed by c_head */
         uint32_t c_head;
         char pad4[60];
+        /* Number of producers/consumers sleeping on a full/empty ring
+         * (lock-free mode) - read after every publish to decide whether a
+         * futex wake is needed, so it is kept away from the heads */
+        uint32_t p_waiters;
+        uint32_t c_waiters;
+        /* enum ring_mode */
+        uint32_t mode;
+        /* Number of single-producer shard rings laid out right after this
+         * ring (0 if the shared ring is used) - see init_shards() */
+        uint32_t num_shards;
+        /* Index of this ring among the shards of the ring before them */
+        uint32_t shard_id;
+        /* Doorbell - shard producers bump it (and futex-wake it) when a
+         * server thread is sleeping on it, i.e. bell_waiters > 0 */
+        uint32_t bell;
+        uint32_t bell_waiters;
+        /* Number of partition rings laid out right after this ring (0 if
+         * the server isn't partitioned) - see init_partitions() */
+        uint32_t num_partitions;
+        /* Offset in the region of the live statistics page the server
+         * threads update, and how many threads it has room for (0 if there
+         * isn't one) - see stats.h */
+        uint64_t stats_off;
+        uint32_t stats_threads;
+        /* Size of the value heap segment (heap_file) if values are handles
+         * of blobs in it, 0 if they are plain values - see value_heap.h */
+        uint64_t heap_size;
+        /* Offset in the region of the client table if the server owns the
+         * region and clients attach to it, 0 if a single client laid it
+         * out - see client_table.h */
+        uint64_t clients_off;
+        char pad5[4];
         /* An array of structs - This is the actual ring */
         struct buffer_descriptor buffer[RING_SIZE];
+        /* Per-slot sequence numbers (lock-free mode) - slot i is free for the
+         * producer at position p when seq[i] == p, and holds data for the
+         * consumer at position c when seq[i] == c + 1 */
+        uint32_t seq[RING_SIZE];
 
         sem_t sem_not_full;
         sem_t sem_not_empty;
@@ -69,6 +144,14 @@ struct __attribute__((packed, aligned(64))) ring {
 */
 int init_ring(struct ring *r);
 
+/*
+ * Initialize the ring with the given synchronization scheme
+ * @param r A pointer to the ring
+ * @param mode RING_LOCKFREE or RING_SEM
+ * @return 0 on success, negative otherwise
+*/
+int init_ring_mode(struct ring *r, enum ring_mode mode);
+
 /*
  * Submit a new item - should be thread-safe
  * This call will block the calling thread if there's not enough space
@@ -87,3 +170,93 @@ void ring_submit(struct ring *r, struct buffer_descriptor *bd);
  * the signature.
 */
 void ring_get(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Submit n items - should be thread-safe
+ * Free slots are reserved with a single head update and published together,
+ * so this costs about as much synchronization as one ring_submit while the
+ * ring has room. Blocks until all n items are in the ring.
+ * @param r The shared ring
+ * @param bds An array of n valid buffer_descriptors
+ * @param n The number of items to submit
+*/
+void ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n);
+
+/*
+ * Get up to n items from the ring - should be thread-safe
+ * Blocks until at least one item is available, then takes every available
+ * item up to n
+ * @param r A pointer to the shared ring
+ * @param bds An array with room for n buffer_descriptors
+ * @param n The maximum number of items to get
+ * @return the number of items copied to bds
+*/
+int ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int n);
+
+/*
+ * Get up to n items from the ring without blocking
+ * @return the number of items copied to bds, 0 if the ring is empty
+*/
+int ring_try_get_batch(struct ring *r, struct buffer_descriptor *bds, int n);
+
+/*
+ * Sharded layout - the shared memory region starts with the main ring,
+ * followed by one RING_SPSC ring per client thread:
+ * | RING | SHARD_0 | SHARD_1 | ... | SHARD_N |
+ * Each shard has exactly one producer (its client thread) and one consumer
+ * (the server thread that owns it), so nobody contends on its heads.
+ * Producers submit to a shard with the usual ring_submit*() calls.
+*/
+
+/*
+ * Initialize n shards behind r (r itself must already be initialized)
+ * @return 0 on success, negative otherwise
+*/
+int init_shards(struct ring *r, int n);
+
+/*
+ * Initialize n shards behind r for any number of producers each (RING_MPSC)
+ * - the submission rings of the client slots, see client_table.h
+ * @return 0 on success, negative otherwise
+*/
+int init_client_rings(struct ring *r, int n);
+
+/* Get a pointer to shard i of r */
+struct ring *ring_shard(struct ring *r, int i);
+
+/*
+ * Partitioned layout - like the sharded one, but with one ring per server
+ * thread instead of one per client thread:
+ * | RING | PART_0 | PART_1 | ... | PART_N |
+ * Partition i holds the requests for the keys key_partition(k, N) maps to
+ * i, and only server thread i consumes it - any client thread may produce
+ * to it, so partitions use the same mode as r.
+*/
+
+/*
+ * Initialize n partitions behind r (r itself must already be initialized)
+ * @return 0 on success, negative otherwise
+*/
+int init_partitions(struct ring *r, int n);
+
+/* Get a pointer to partition i of r */
+struct ring *ring_partition(struct ring *r, int i);
+
+/*
+ * A server thread that found all of its shards empty (for as long as its
+ * wait strategy lets it spin) calls doorbell_arm(),
+ * polls its shards once more, then calls doorbell_wait() - sleeping only if
+ * that last poll found nothing, i.e. sleep = true
+ * @return the doorbell value to pass to doorbell_wait()
+*/
+uint32_t doorbell_arm(struct ring *r);
+void doorbell_wait(struct ring *r, uint32_t seen, bool sleep);
+
+/*
+ * Post the result of a request to the client's status board: copy every
+ * field but ready, then set ready (and wake the client if it is sleeping on
+ * it) - a plain memcpy would overwrite COMP_WAITING and lose the wakeup
+ * @param result where the client expects the result (shared memory + res_off)
+ * @param bd the result
+*/
+void complete_request(struct buffer_descriptor *result, struct buffer_descriptor *bd);
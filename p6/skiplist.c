@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "skiplist.h"
+
+/* State of the calling thread's node height generator (xorshift64) */
+static __thread uint64_t height_state = 0;
+
+/* Height of a new node: each level up has a 1/4 chance */
+static uint32_t random_height() {
+    if (height_state == 0)
+        height_state = ((uintptr_t) &height_state | 1) * 0x9e3779b97f4a7c15ull;
+    height_state ^= height_state << 13;
+    height_state ^= height_state >> 7;
+    height_state ^= height_state << 17;
+    uint64_t r = height_state;
+    uint32_t h = 1;
+    while (h < SKIPLIST_MAX_HEIGHT && (r & 3) == 0) {
+        h++;
+        r >>= 2;
+    }
+    return h;
+}
+
+static inline size_t node_size(uint32_t height) {
+    return sizeof(struct skiplist_node) + height * sizeof(struct skiplist_node*);
+}
+
+static inline struct skiplist_node *next_of(struct skiplist_node *x, int level) {
+    return __atomic_load_n(&x->next[level], __ATOMIC_ACQUIRE);
+}
+
+int init_skiplist(struct skiplist *l) {
+    l->head = calloc(1, node_size(SKIPLIST_MAX_HEIGHT));
+    if (l->head == NULL)
+        return -1;
+    l->head->height = SKIPLIST_MAX_HEIGHT;
+    for (uint32_t h = 1; h <= SKIPLIST_MAX_HEIGHT; h++)
+        slab_init(&l->nodes[h - 1], node_size(h));
+    return 0;
+}
+
+void free_skiplist(struct skiplist *l) {
+    for (uint32_t h = 1; h <= SKIPLIST_MAX_HEIGHT; h++)
+        slab_destroy(&l->nodes[h - 1]);
+    free(l->head);
+    l->head = NULL;
+}
+
+/**
+ * Find where k goes on every level.
+ * @param preds set to the last node with a key below k on each level.
+ * @param succs set to the node right after preds on each level.
+ * @return the node of k, NULL if k is not in the list.
+*/
+static struct skiplist_node *skiplist_find(struct skiplist *l, key_type k,
+                                           struct skiplist_node **preds, struct skiplist_node **succs) {
+    struct skiplist_node *x = l->head;
+    for (int level = SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--) {
+        struct skiplist_node *next = next_of(x, level);
+        while (next != NULL && next->k < k) {
+            x = next;
+            next = next_of(x, level);
+        }
+        preds[level] = x;
+        succs[level] = next;
+    }
+    return succs[0] != NULL && succs[0]->k == k ? succs[0] : NULL;
+}
+
+/* First node with a key >= k, NULL if there is none */
+static struct skiplist_node *skiplist_lower_bound(struct skiplist *l, key_type k) {
+    struct skiplist_node *x = l->head, *next = NULL;
+    for (int level = SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--) {
+        next = next_of(x, level);
+        while (next != NULL && next->k < k) {
+            x = next;
+            next = next_of(x, level);
+        }
+    }
+    return next;
+}
+
+int skiplist_update(struct skiplist *l, key_type k, enum kv_op op, value_type v, value_type cmp,
+                    value_type *old) {
+    struct skiplist_node *preds[SKIPLIST_MAX_HEIGHT], *succs[SKIPLIST_MAX_HEIGHT];
+    struct skiplist_node *node = NULL;
+    uint32_t height = 0;
+    while (true) {
+        struct skiplist_node *found = skiplist_find(l, k, preds, succs);
+        if (found != NULL) {
+            value_type prev = __atomic_load_n(&found->v, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&found->v, &prev, kv_apply(op, prev, v, cmp), true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+            if (old != NULL)
+                *old = prev;
+            if (node != NULL) // Somebody else inserted k first
+                slab_free(&l->nodes[height - 1], node);
+            return 0;
+        }
+        if (!kv_inserts(op, v, cmp)) {
+            if (old != NULL)
+                *old = 0;
+            return 0;
+        }
+        if (node == NULL) {
+            height = random_height();
+            node = slab_alloc(&l->nodes[height - 1]);
+            if (node == NULL)
+                return -1;
+            node->k = k;
+            node->height = height;
+        }
+        node->v = kv_apply(op, 0, v, cmp);
+        for (uint32_t level = 0; level < height; level++)
+            node->next[level] = succs[level];
+        // Once it's on the bottom level, the node is in the list
+        if (__atomic_compare_exchange_n(&preds[0]->next[0], &succs[0], node, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (old != NULL)
+        *old = 0;
+    // Nobody reaches the node through a level it isn't linked on yet, so
+    // its link there can be fixed up until our CAS goes through
+    for (uint32_t level = 1; level < height; level++) {
+        while (!__atomic_compare_exchange_n(&preds[level]->next[level], &succs[level], node, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            skiplist_find(l, k, preds, succs);
+            __atomic_store_n(&node->next[level], succs[level], __ATOMIC_RELAXED);
+        }
+    }
+    return 1;
+}
+
+value_type skiplist_get(struct skiplist *l, key_type k) {
+    struct skiplist_node *node = skiplist_lower_bound(l, k);
+    if (node == NULL || node->k != k)
+        return 0;
+    return __atomic_load_n(&node->v, __ATOMIC_RELAXED);
+}
+
+int skiplist_scan(struct skiplist *l, key_type start, struct kv_pair *pairs, int n) {
+    int m = 0;
+    for (struct skiplist_node *node = skiplist_lower_bound(l, start); node != NULL && m < n;
+         node = next_of(node, 0)) {
+        pairs[m].k = node->k;
+        pairs[m].v = __atomic_load_n(&node->v, __ATOMIC_RELAXED);
+        m++;
+    }
+    return m;
+}
+
+void skiplist_for_each(struct skiplist *l, void (*fn)(void *arg, key_type k, value_type v), void *arg) {
+    for (struct skiplist_node *node = next_of(l->head, 0); node != NULL; node = next_of(node, 0))
+        fn(arg, node->k, __atomic_load_n(&node->v, __ATOMIC_RELAXED));
+}
+
+void skiplist_print_stats(struct skiplist *l, FILE *f) {
+    char name[32];
+    for (uint32_t h = 1; h <= SKIPLIST_MAX_HEIGHT; h++) {
+        if (l->nodes[h - 1].chunks == NULL)
+            continue; // No node that tall
+        snprintf(name, sizeof(name), "skiplist_node (height %u)", h);
+        slab_print_stats(&l->nodes[h - 1], name, f);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+#include "slab.h"
+
+/* Tallest a node gets - with a 1/4 chance of growing each level, enough
+ * for every 32-bit key */
+#define SKIPLIST_MAX_HEIGHT 16
+
+/**
+ * A key-value pair with its forward links, one per level it is on. Nodes
+ * are never removed, so a reader can follow any link it loaded.
+*/
+struct skiplist_node {
+    key_type k;
+    value_type v;
+    uint32_t height;
+    struct skiplist_node *next[];
+};
+
+/**
+ * An ordered index of the keys: a skiplist whose nodes are linked in with
+ * a CAS per level, bottom level first. Readers take no lock at all - a node
+ * is in the list once it is on the bottom level, the upper levels only
+ * make it faster to find. Nodes of each height come from a slab of their
+ * own.
+*/
+struct skiplist {
+    struct skiplist_node *head; // Sentinel on every level, holds no key
+    struct slab nodes[SKIPLIST_MAX_HEIGHT]; // nodes[h - 1] holds the nodes of height h
+};
+
+/**
+ * Initialize the skiplist.
+ * @return 0 on success, -1 if we're out of memory.
+*/
+int init_skiplist(struct skiplist *l);
+
+void free_skiplist(struct skiplist *l);
+
+/**
+ * Apply op to the value of k atomically (a CAS on the node's value),
+ * inserting k if it isn't present (see kv_inserts()).
+ * @param old if not NULL, set to the value found (0 if there was none).
+ * @return 1 if the key was inserted, 0 if it was updated (or not inserted),
+ * -1 if we're out of memory.
+*/
+int skiplist_update(struct skiplist *l, key_type k, enum kv_op op, value_type v, value_type cmp,
+                    value_type *old);
+
+/**
+ * Put the pair into the list, or replace the value if the key is already
+ * present.
+ * @param old if not NULL, set to the value replaced (0 if there was none).
+ * @return 1 if the key was inserted, 0 if it was replaced, -1 if we're out
+ * of memory.
+*/
+static inline int skiplist_put(struct skiplist *l, key_type k, value_type v, value_type *old) {
+    return skiplist_update(l, k, KV_SET, v, 0, old);
+}
+
+/**
+ * @return the value of k, 0 if k is not present.
+*/
+value_type skiplist_get(struct skiplist *l, key_type k);
+
+/**
+ * Copy the first n pairs with keys >= start, in key order, to pairs.
+ * Pairs put meanwhile may or may not be seen.
+ * @return the number of pairs copied.
+*/
+int skiplist_scan(struct skiplist *l, key_type start, struct kv_pair *pairs, int n);
+
+/**
+ * Call fn(arg, k, v) for every pair, in key order.
+*/
+void skiplist_for_each(struct skiplist *l, void (*fn)(void *arg, key_type k, value_type v), void *arg);
+
+void skiplist_print_stats(struct skiplist *l, FILE *f);
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+/* Index of the calling thread's cache, handed out on first use */
+static __thread int slab_tid = -1;
+static int next_slab_tid = 0;
+
+static struct slab_cache *get_cache(struct slab *s) {
+    if (slab_tid < 0)
+        slab_tid = __atomic_fetch_add(&next_slab_tid, 1, __ATOMIC_RELAXED);
+    return slab_tid < SLAB_MAX_THREADS ? &s->caches[slab_tid] : NULL;
+}
+
+void slab_init(struct slab *s, size_t obj_size) {
+    memset(s, 0, sizeof(struct slab));
+    // Keep objects pointer-aligned, they hold the free list link
+    s->obj_size = (obj_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    pthread_mutex_init(&s->lock, NULL);
+}
+
+void slab_destroy(struct slab *s) {
+    void *chunk = s->chunks;
+    while (chunk != NULL) {
+        void *next = *(void**) chunk;
+        free(chunk);
+        chunk = next;
+    }
+    s->chunks = NULL;
+    pthread_mutex_destroy(&s->lock);
+}
+
+/**
+ * Give a cache a fresh chunk to carve from. The first object-sized piece of
+ * the chunk links it into the slab's chunk list.
+ * @return 0 on success, -1 if malloc failed.
+*/
+static int refill(struct slab *s, struct slab_cache *c, bool locked) {
+    char *chunk = malloc(SLAB_CHUNK_SIZE);
+    if (chunk == NULL)
+        return -1;
+    if (!locked)
+        pthread_mutex_lock(&s->lock);
+    *(void**) chunk = s->chunks;
+    s->chunks = chunk;
+    if (!locked)
+        pthread_mutex_unlock(&s->lock);
+    c->bump = chunk + s->obj_size;
+    c->bump_end = chunk + SLAB_CHUNK_SIZE;
+    c->chunks++;
+    return 0;
+}
+
+static void *cache_alloc(struct slab *s, struct slab_cache *c, bool locked) {
+    void *obj = c->free_list;
+    if (obj != NULL) {
+        c->free_list = *(void**) obj;
+    }
+    else {
+        if (c->bump + s->obj_size > c->bump_end && refill(s, c, locked) < 0)
+            return NULL;
+        obj = c->bump;
+        c->bump += s->obj_size;
+    }
+    c->allocs++;
+    return obj;
+}
+
+void *slab_alloc(struct slab *s) {
+    struct slab_cache *c = get_cache(s);
+    if (c != NULL)
+        return cache_alloc(s, c, false);
+    pthread_mutex_lock(&s->lock);
+    void *obj = cache_alloc(s, &s->shared, true);
+    pthread_mutex_unlock(&s->lock);
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj) {
+    struct slab_cache *c = get_cache(s);
+    bool locked = c == NULL;
+    if (locked) {
+        c = &s->shared;
+        pthread_mutex_lock(&s->lock);
+    }
+    *(void**) obj = c->free_list;
+    c->free_list = obj;
+    c->frees++;
+    if (locked)
+        pthread_mutex_unlock(&s->lock);
+}
+
+void slab_print_stats(struct slab *s, const char *name, FILE *f) {
+    uint64_t allocs = s->shared.allocs, frees = s->shared.frees, chunks = s->shared.chunks;
+    int threads = 0;
+    for (int i = 0; i < SLAB_MAX_THREADS; i++) {
+        struct slab_cache *c = &s->caches[i];
+        if (c->allocs == 0 && c->frees == 0)
+            continue;
+        threads++;
+        allocs += c->allocs;
+        frees += c->frees;
+        chunks += c->chunks;
+    }
+    uint64_t live = allocs - frees;
+    double reserved = (double) chunks * SLAB_CHUNK_SIZE;
+    fprintf(f, "%s slab: %lu B objects, %lu chunks (%.1f MiB), %d threads\n",
+            name, s->obj_size, chunks, reserved / (1 << 20), threads);
+    fprintf(f, "%s slab: %lu allocs, %lu frees, %lu live (%.1f%% of reserved bytes in use)\n",
+            name, allocs, frees, live, reserved > 0 ? 100.0 * live * s->obj_size / reserved : 0.0);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Size of the chunks objects are carved out of */
+#define SLAB_CHUNK_SIZE (1 << 20)
+
+/* Threads that get their own cache - any others share one behind the lock */
+#define SLAB_MAX_THREADS 256
+
+/**
+ * A thread's view of a slab: objects it freed (linked through their first
+ * word) and the unused end of the chunk it is carving from.
+*/
+struct __attribute__((aligned(64))) slab_cache {
+    void *free_list;
+    char *bump;
+    char *bump_end;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t chunks;
+};
+
+/**
+ * A fixed-size object allocator. Objects are carved out of SLAB_CHUNK_SIZE
+ * chunks with per-thread free lists, so allocating takes no lock and no
+ * per-object header. Objects are only returned to the free lists, never to
+ * malloc - memory of a freed object stays mapped until slab_destroy().
+*/
+struct slab {
+    size_t obj_size;
+    pthread_mutex_t lock; // Protects chunks and shared
+    void *chunks; // Every chunk we carved from, linked through their first word
+    struct slab_cache shared; // Cache for threads past SLAB_MAX_THREADS
+    struct slab_cache caches[SLAB_MAX_THREADS];
+};
+
+/**
+ * Initialize a slab.
+ * @param obj_size the size of its objects, at least a pointer.
+*/
+void slab_init(struct slab *s, size_t obj_size);
+
+/**
+ * Release every chunk of the slab at once, including objects never freed.
+*/
+void slab_destroy(struct slab *s);
+
+/**
+ * Allocate an object from the calling thread's cache.
+ * @return the object, NULL if we're out of memory.
+*/
+void *slab_alloc(struct slab *s);
+
+/**
+ * Put an object on the calling thread's free list.
+*/
+void slab_free(struct slab *s, void *obj);
+
+/**
+ * Print the slab's allocation statistics, summed over all threads.
+ * @param name what the objects are, for the report.
+*/
+void slab_print_stats(struct slab *s, const char *name, FILE *f);
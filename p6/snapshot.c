@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+/* Collects the pairs of the store being snapshotted into the image */
+struct snapshot_image {
+    struct bucket_table bt;
+    uint64_t count;
+};
+
+static void snapshot_put(void *arg, key_type k, value_type v) {
+    struct snapshot_image *img = arg;
+    if (bucket_put(&img->bt, k, v, NULL) == 0)
+        img->count++;
+}
+
+/* Puts the pairs of a snapshot's image into the store it is restored to */
+static void snapshot_restore(void *arg, key_type k, value_type v) {
+    put(arg, k, v);
+}
+
+int snapshot_write(struct kv_store *s, const char *path, uint64_t wal_offset) {
+    // A bucket table can't grow after it's loaded, so leave a chained
+    // table (or skiplist) room to keep growing
+    uint64_t capacity = s->size;
+    if (s->engine != ENGINE_BUCKET && __atomic_load_n(&s->count, __ATOMIC_RELAXED) * 2 > capacity)
+        capacity = __atomic_load_n(&s->count, __ATOMIC_RELAXED) * 2;
+    if (capacity > INT_MAX) {
+        fprintf(stderr, "ERROR: %lu keys are too many for a snapshot.\n", capacity);
+        return -1;
+    }
+
+    struct snapshot_image img = {.count = 0};
+    if (init_bucket_table(&img.bt, capacity) < 0)
+        return -1;
+    img.bt.exclusive = true;
+    kv_for_each(s, &snapshot_put, &img);
+
+    char header[SNAPSHOT_HEADER_SIZE] = {0};
+    struct snapshot_header *hdr = (struct snapshot_header*) header;
+    hdr->magic = SNAPSHOT_MAGIC;
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->hash_policy = HASH_POLICY;
+    hdr->hash_pow2 = HASH_POW2;
+    hdr->bucket_size = sizeof(struct kv_bucket);
+    hdr->num_buckets = img.bt.num_buckets;
+    hdr->zero_val = img.bt.zero_val;
+    hdr->count = img.count;
+    hdr->capacity = capacity;
+    hdr->wal_offset = wal_offset;
+    hdr->engine = s->engine;
+    hdr->size = s->size;
+
+    char tmp[strlen(path) + 5];
+    sprintf(tmp, "%s.tmp", path);
+    int rc = -1;
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror("fopen");
+        goto out;
+    }
+    if (fwrite(header, sizeof(header), 1, f) != 1 ||
+        fwrite(img.bt.buckets, sizeof(struct kv_bucket), img.bt.num_buckets, f) != img.bt.num_buckets ||
+        fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror("snapshot write");
+        fclose(f);
+        goto out;
+    }
+    fclose(f);
+    if (rename(tmp, path) != 0) {
+        perror("rename");
+        goto out;
+    }
+    rc = 0;
+out:
+    free_bucket_table(&img.bt);
+    return rc;
+}
+
+int snapshot_load(struct kv_store *s, const char *path, uint64_t *wal_offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+        return 1;
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct snapshot_header hdr;
+    struct stat statbuf;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &statbuf) != 0 ||
+        hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+        hdr.hash_policy != HASH_POLICY || hdr.hash_pow2 != HASH_POW2 ||
+        hdr.bucket_size != sizeof(struct kv_bucket) || hdr.num_buckets == 0 ||
+        hdr.capacity > INT_MAX || hdr.size > INT_MAX || hdr.engine > ENGINE_SKIPLIST ||
+        (uint64_t) statbuf.st_size != SNAPSHOT_HEADER_SIZE + (uint64_t) hdr.num_buckets * sizeof(struct kv_bucket)) {
+        fprintf(stderr, "ERROR: %s is not a snapshot this server can use.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // Nothing is read yet - pages fault in as lookups touch them
+    void *map = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    struct kv_store img = {.engine = ENGINE_BUCKET, .size = hdr.capacity, .count = hdr.count};
+    img.bt.num_buckets = hdr.num_buckets;
+    img.bt.buckets = (struct kv_bucket*) ((char*) map + SNAPSHOT_HEADER_SIZE);
+    img.bt.zero_val = hdr.zero_val;
+    img.bt.exclusive = false;
+    img.bt.map = map;
+    img.bt.map_len = statbuf.st_size;
+    *wal_offset = hdr.wal_offset;
+    if (hdr.engine == ENGINE_BUCKET) {
+        *s = img;
+        return 0;
+    }
+
+    // Any other engine is built from the image, which is then dropped
+    if (init_kv_store(s, hdr.engine, hdr.size) < 0) {
+        fprintf(stderr, "ERROR: could not allocate a table for %s.\n", path);
+        free_kv_store(&img);
+        return -1;
+    }
+    kv_for_each(&img, &snapshot_restore, s);
+    free_kv_store(&img);
+    return 0;
+}
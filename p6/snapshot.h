@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include "common.h"
+#include "kv_table.h"
+
+#define SNAPSHOT_MAGIC 0x70366b76736e6170ull // "pansvk6p"
+#define SNAPSHOT_VERSION 2
+
+/* The buckets start this far into the file, so they are page aligned when
+ * it is mapped */
+#define SNAPSHOT_HEADER_SIZE 4096
+
+/**
+ * Start of a snapshot file. The rest of the file is a bucket table image -
+ * num_buckets struct kv_buckets, laid out exactly as in memory, so the
+ * server can map the file and look keys up in it directly. The image only
+ * makes sense to a server built with the same hash policy and bucket
+ * layout, which is what the other fields check. engine and size say what
+ * the snapshotted store was, so it comes back as the same engine.
+*/
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hash_policy; // HASH_POLICY
+    uint32_t hash_pow2;   // HASH_POW2
+    uint32_t bucket_size; // sizeof(struct kv_bucket)
+    uint32_t num_buckets;
+    value_type zero_val;
+    uint64_t count; // Keys in the image
+    uint64_t capacity; // Keys the table was sized for
+    uint64_t wal_offset; // Log position the image covers (see snapshot_write())
+    uint32_t engine; // enum kv_engine of the snapshotted store
+    uint32_t size; // and its size, as passed to init_kv_store()
+};
+
+/**
+ * Write a snapshot of s to path, while other threads keep using s. The
+ * image is written to path.tmp first and renamed over path once complete,
+ * so path always holds a whole snapshot.
+ * The snapshot is fuzzy - puts that happen while it is taken may be missing
+ * - so a write-ahead log replayed from wal_offset on top of it is needed to
+ * get all of them back. Every put logged before wal_offset is in the image.
+ * @param wal_offset the write-ahead log's size when we started, or 0.
+ * @return 0 on success, -1 on error.
+*/
+int snapshot_write(struct kv_store *s, const char *path, uint64_t wal_offset);
+
+/**
+ * Set s up as a store of the engine the snapshot at path was taken of. A
+ * bucket table lives in the snapshot: the file is mapped privately and
+ * faulted in as keys are looked up, and puts change the server's copy of
+ * the pages, never the file. A chained table or skiplist is built anew and
+ * filled from the image.
+ * @param wal_offset set to the log position the snapshot covers.
+ * @return 0 on success, 1 if there is no snapshot at path, -1 if it can't
+ * be used.
+*/
+int snapshot_load(struct kv_store *s, const char *path, uint64_t *wal_offset);
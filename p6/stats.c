@@ -0,0 +1,5 @@
+#include <stddef.h>
+
+#include "stats.h"
+
+__thread struct thread_stats *my_stats = NULL;
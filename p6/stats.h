@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Live server statistics, published in the shared memory region so kvstat
+ * can read them while the server runs. The client reserves the area (see
+ * ring.stats_off) and each server thread only ever writes its own
+ * thread_stats, which starts on a cache line of its own.
+*/
+
+#define STATS_MAGIC 0x7374617473366bull // "k6stats"
+
+/* Request types we count (enum REQUEST_TYPE values below this) */
+#define STATS_REQ_TYPES 8
+
+/* Length histogram buckets: 0, 1, 2, 3, 4-7, 8-15, 16-31, 32+ */
+#define STATS_LEN_BUCKETS 8
+
+struct __attribute__((aligned(64))) thread_stats {
+    uint64_t requests[STATS_REQ_TYPES]; /* requests served, by type */
+    uint64_t keys;                      /* keys looked up or put (MGET/MPUT count each) */
+    uint64_t batches;                   /* batches taken from the ring */
+    uint64_t empty_waits;               /* times we found nothing to do and went to wait */
+    uint64_t lock_contended;            /* lock acquisitions that had to wait for another thread */
+    uint64_t chain_len[STATS_LEN_BUCKETS]; /* nodes walked per chained table lookup/put */
+    uint64_t probe_len[STATS_LEN_BUCKETS]; /* buckets probed per bucket table lookup/put */
+    uint64_t hot_hits;                  /* GETs served from the thread's hot key cache */
+    uint64_t evictions;                 /* keys evicted to stay under the memory cap */
+};
+
+struct __attribute__((aligned(64))) stats_page {
+    uint64_t magic;
+    uint32_t num_threads; /* entries of threads[] */
+    struct thread_stats threads[];
+};
+
+/* Bytes a stats_page for n threads takes */
+static inline uint64_t stats_page_size(int n) {
+    return sizeof(struct stats_page) + (uint64_t) n * sizeof(struct thread_stats);
+}
+
+static inline int stats_len_bucket(uint64_t len) {
+    if (len < 4)
+        return len;
+    int b = 63 - __builtin_clzll(len) + 2; /* 4-7 -> 4, 8-15 -> 5, ... */
+    return b < STATS_LEN_BUCKETS ? b : STATS_LEN_BUCKETS - 1;
+}
+
+/* Stats of the calling thread, NULL if it doesn't keep any */
+extern __thread struct thread_stats *my_stats;
+
+/* Only the owner writes its counters - the atomic store just keeps a
+ * concurrent reader from seeing a torn value */
+#define STAT_ADD(field, n) do { \
+    struct thread_stats *st_ = my_stats; \
+    if (st_ != NULL) \
+        __atomic_store_n(&st_->field, st_->field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+#define STAT_INC(field) STAT_ADD(field, 1)
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "common.h"
+#include "kv_table.h"
+#include "workload.h"
+
+/*
+ * Runs gets and puts straight against the table engines - no ring, no
+ * server threads in between - to tell a table regression from a ring one.
+ * Each engine starts from a table of -s indices (like the server's -s),
+ * holding keys 1..num_keys. Threads then do ops_per_thread gets and puts
+ * each, of uniform or zipf keys, and we report the operations per second.
+*/
+
+#define REPEAT 5
+#define MAX_THREADS 128
+
+int num_threads = 1;
+int table_size = 1000;
+int num_keys = 1 << 16;
+int ops_per_thread = 1 << 20;
+double skew = 0;
+double put_ratio = 0.1;
+int repeat = REPEAT;
+int pin = 0;
+int csv = 0;
+const char *engine_name = NULL; /* NULL: all of them */
+
+struct kv_store store;
+key_type **keys; /* Keys of each thread's operations */
+uint8_t **is_put; /* Whether each of them is a put */
+
+/* Uniform double in (0, 1] */
+static double rand01() {
+	return (random() + 1.0) / ((double) RAND_MAX + 1.0);
+}
+
+/* Draw every thread's operations up front, so random() isn't timed */
+static void gen_ops() {
+	keys = malloc(num_threads * sizeof(key_type *));
+	is_put = malloc(num_threads * sizeof(uint8_t *));
+	if (keys == NULL || is_put == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	srandom(537);
+	for (int t = 0; t < num_threads; t++) {
+		keys[t] = malloc(ops_per_thread * sizeof(key_type));
+		is_put[t] = malloc(ops_per_thread);
+		if (keys[t] == NULL || is_put[t] == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < ops_per_thread; i++) {
+			key_type k = skew > 1 ? zipf_sample(skew, rand01) : random();
+			keys[t][i] = (k - 1) % num_keys + 1;
+			is_put[t][i] = rand01() <= put_ratio;
+		}
+	}
+}
+
+static void *worker(void *arg) {
+	int tid = (int) (long) arg;
+	if (pin)
+		pin_thread(tid, false);
+	key_type *k = keys[tid];
+	uint8_t *p = is_put[tid];
+	value_type sum = 0;
+	for (int i = 0; i < ops_per_thread; i++) {
+		if (p[i])
+			put(&store, k[i], k[i] + i);
+		else
+			sum += get(&store, k[i]);
+	}
+	return (void*) (long) sum;
+}
+
+/* One run, in millions of operations per second */
+static double run(void *arg) {
+	(void) arg;
+	pthread_t threads[MAX_THREADS];
+	struct timespec s, e;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (long i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL, worker, (void*) i);
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	return (double) num_threads * ops_per_thread / get_elapsed_ns(&s, &e) * 1e3;
+}
+
+/* Fill an engine's table, run repeat times (after a warm-up run) and print the median */
+static void bench(const char *name) {
+	if (engine_name != NULL && strcmp(engine_name, name) != 0)
+		return;
+	enum kv_engine engine;
+	parse_engine(name, &engine);
+	if (init_kv_store(&store, engine, table_size) != 0) {
+		fprintf(stderr, "ERROR: could not initialize the %s table\n", name);
+		exit(EXIT_FAILURE);
+	}
+	for (key_type k = 1; k <= (key_type) num_keys; k++)
+		put(&store, k, k);
+
+	double mops[REPEAT * 4];
+	double median = bench_repeat(run, NULL, repeat, mops);
+	if (csv)
+		printf("table,%s,%d,%d,%d,%.2f,%.2f,%.3f,%.3f,%.3f\n", name, num_threads, table_size, num_keys,
+		       skew, put_ratio, median, mops[0], mops[repeat - 1]);
+	else
+		printf("%-10s %7d %8d %8d %5.2f %5.2f | %8.2f %8.2f %8.2f\n", name, num_threads, table_size, num_keys,
+		       skew, put_ratio, median, mops[0], mops[repeat - 1]);
+	free_kv_store(&store);
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-n num_threads] [-s table_size] [-k num_keys] [-o ops] [-z skew] [-r ratio] [-R repeat] [-E engine] [-A] [-q]\n", name);
+	printf("-h show this help\n");
+	printf("-n number of threads (default: %d)\n", num_threads);
+	printf("-s initial table size, like the kv_store program's -s (default: %d)\n", table_size);
+	printf("-k number of keys, all put before the runs (default: %d)\n", num_keys);
+	printf("-o operations per thread per run (default: %d)\n", ops_per_thread);
+	printf("-z skew: <= 1 for uniform keys, > 1 for zipf distributed keys (default: %.1f)\n", skew);
+	printf("-r share of the operations that are puts (default: %.1f)\n", put_ratio);
+	printf("-R timed runs of each engine, after one warm-up run (default: %d, max %d)\n", repeat, REPEAT * 4);
+	printf("-E only run one engine: 'chain', 'bucket' or 'skiplist' (default: all)\n");
+	printf("-A if set, pins the threads to cores\n");
+	printf("-q if set, prints CSV rows (bench,engine,threads,table_size,keys,skew,put_ratio,median,min,max) without a header\n");
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hn:s:k:o:z:r:R:E:Aq")) != -1) {
+		switch (op) {
+		case 'n':
+		num_threads = atoi(optarg);
+		break;
+
+		case 's':
+		table_size = atoi(optarg);
+		break;
+
+		case 'k':
+		num_keys = atoi(optarg);
+		break;
+
+		case 'o':
+		ops_per_thread = atoi(optarg);
+		break;
+
+		case 'z':
+		skew = atof(optarg);
+		break;
+
+		case 'r':
+		put_ratio = atof(optarg);
+		break;
+
+		case 'R':
+		repeat = atoi(optarg);
+		break;
+
+		case 'E':
+		engine_name = optarg;
+		break;
+
+		case 'A':
+		pin = 1;
+		break;
+
+		case 'q':
+		csv = 1;
+		break;
+
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+
+		default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+		}
+	}
+	enum kv_engine engine;
+	if (num_threads < 1 || num_threads > MAX_THREADS || table_size < 1 || num_keys < 1 || ops_per_thread < 1 ||
+	    skew < 0 || put_ratio < 0 || put_ratio > 1 || repeat < 1 || repeat > REPEAT * 4 ||
+	    (engine_name != NULL && parse_engine(engine_name, &engine) < 0)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	/* The bucket engine doesn't grow, so it needs room for every key */
+	if (table_size < num_keys && (engine_name == NULL || strcmp(engine_name, "bucket") == 0))
+		fprintf(stderr, "WARNING: -s %d is below -k %d, the bucket table will drop keys\n", table_size, num_keys);
+
+	gen_ops();
+	if (!csv)
+		printf("%-10s %7s %8s %8s %5s %5s | %8s %8s %8s\n", "engine", "threads", "size", "keys",
+		       "skew", "puts", "Mops/s", "min", "max");
+	bench("chain");
+	bench("bucket");
+	bench("skiplist");
+	return 0;
+}
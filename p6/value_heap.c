@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include "value_heap.h"
+
+void heap_init(struct value_heap *h, uint64_t size, uint32_t num_readers) {
+    h->magic = HEAP_MAGIC;
+    h->size = size;
+    h->bump = HEAP_HEADER_SIZE;
+    h->num_readers = num_readers;
+    h->global_epoch = 1;
+}
+
+/* Smallest class whose blobs hold len bytes of data, -1 if none */
+static int heap_class(uint32_t len) {
+    uint64_t need = sizeof(struct blob) + (uint64_t) len;
+    for (int cls = 0; cls < HEAP_CLASSES; cls++)
+        if ((uint64_t) HEAP_UNIT << cls >= need)
+            return cls;
+    return -1;
+}
+
+static uint32_t heap_pop(struct value_heap *h, int cls) {
+    uint64_t head = __atomic_load_n(&h->free_heads[cls], __ATOMIC_ACQUIRE);
+    while ((uint32_t) head != 0) {
+        // The blob may get popped and reused under us - then next is
+        // garbage, but the pop count changed and the CAS fails
+        uint32_t next = __atomic_load_n(&heap_blob(h, (uint32_t) head)->next, __ATOMIC_RELAXED);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&h->free_heads[cls], &head, new_head, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return (uint32_t) head;
+    }
+    return 0;
+}
+
+static void heap_push(struct value_heap *h, int cls, uint32_t handle) {
+    struct blob *b = heap_blob(h, handle);
+    uint64_t head = __atomic_load_n(&h->free_heads[cls], __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&b->next, (uint32_t) head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&h->free_heads[cls], &head, (head & ~0xffffffffull) | handle,
+                                          true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint32_t heap_alloc(struct value_heap *h, uint32_t len) {
+    int cls = heap_class(len);
+    if (cls < 0)
+        return 0;
+    uint32_t handle = heap_pop(h, cls);
+    if (handle == 0) {
+        uint64_t bytes = (uint64_t) HEAP_UNIT << cls;
+        uint64_t off = __atomic_fetch_add(&h->bump, bytes, __ATOMIC_RELAXED);
+        if (off + bytes > h->size || off / HEAP_UNIT > UINT32_MAX)
+            return 0;
+        handle = off / HEAP_UNIT;
+    }
+    struct blob *b = heap_blob(h, handle);
+    b->len = len;
+    b->cls = cls;
+    return handle;
+}
+
+bool heap_valid(struct value_heap *h, uint32_t handle) {
+    uint64_t off = (uint64_t) handle * HEAP_UNIT;
+    if (off < HEAP_HEADER_SIZE || off + sizeof(struct blob) > h->size)
+        return false;
+    struct blob *b = heap_blob(h, handle);
+    uint32_t cls = __atomic_load_n(&b->cls, __ATOMIC_RELAXED);
+    return cls < HEAP_CLASSES && off + ((uint64_t) HEAP_UNIT << cls) <= h->size;
+}
+
+uint64_t heap_enter(struct value_heap *h, int reader) {
+    uint64_t *mine = &h->readers[reader].epoch;
+    uint64_t epoch = __atomic_load_n(&h->global_epoch, __ATOMIC_SEQ_CST);
+    // An older epoch that is still announced covers this request too
+    if (__atomic_load_n(mine, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(mine, epoch, __ATOMIC_SEQ_CST);
+    return epoch;
+}
+
+void heap_announce(struct value_heap *h, int reader, uint64_t epoch) {
+    __atomic_store_n(&h->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Free the blobs of rl that were retired before every announced epoch */
+static void heap_reclaim(struct value_heap *h, struct retire_list *rl) {
+    // Readers that announce from now on can't get the blobs we have
+    __atomic_add_fetch(&h->global_epoch, 1, __ATOMIC_SEQ_CST);
+    uint64_t min = UINT64_MAX;
+    uint32_t n = h->num_readers < HEAP_MAX_READERS ? h->num_readers : HEAP_MAX_READERS;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t epoch = __atomic_load_n(&h->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < min)
+            min = epoch;
+    }
+    int kept = 0;
+    for (int i = 0; i < rl->len; i++) {
+        if (rl->epochs[i] >= min) {
+            rl->handles[kept] = rl->handles[i];
+            rl->epochs[kept++] = rl->epochs[i];
+            continue;
+        }
+        heap_push(h, heap_blob(h, rl->handles[i])->cls, rl->handles[i]);
+        __atomic_add_fetch(&h->freed, 1, __ATOMIC_RELAXED);
+    }
+    rl->len = kept;
+}
+
+void heap_retire(struct value_heap *h, struct retire_list *rl, uint32_t handle) {
+    if (rl->len == rl->cap) {
+        int cap = rl->cap > 0 ? rl->cap * 2 : HEAP_RETIRE_BATCH * 2;
+        uint32_t *handles = realloc(rl->handles, cap * sizeof(uint32_t));
+        uint64_t *epochs = realloc(rl->epochs, cap * sizeof(uint64_t));
+        if (handles != NULL)
+            rl->handles = handles;
+        if (epochs != NULL)
+            rl->epochs = epochs;
+        if (handles == NULL || epochs == NULL)
+            return; // Leak it, rather than risk freeing it too early
+        rl->cap = cap;
+    }
+    rl->handles[rl->len] = handle;
+    rl->epochs[rl->len++] = __atomic_load_n(&h->global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&h->retired, 1, __ATOMIC_RELAXED);
+    if (rl->len % HEAP_RETIRE_BATCH == 0)
+        heap_reclaim(h, rl);
+}
+
+void heap_print_stats(struct value_heap *h, FILE *f) {
+    uint64_t bump = __atomic_load_n(&h->bump, __ATOMIC_RELAXED);
+    fprintf(f, "value heap: %.1f of %.1f MiB handed out, %lu blobs retired, %lu freed\n",
+            (double) (bump < h->size ? bump : h->size) / (1 << 20), (double) h->size / (1 << 20),
+            __atomic_load_n(&h->retired, __ATOMIC_RELAXED), __atomic_load_n(&h->freed, __ATOMIC_RELAXED));
+}
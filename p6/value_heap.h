@@ -0,0 +1,127 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+
+/*
+ * Variable-length values, kept out of line in a second shared memory
+ * segment (heap_file) that the client and the server both map:
+ * | struct value_heap (HEAP_HEADER_SIZE) | blobs ... |
+ * A client thread allocates a blob, writes the value's bytes into it and
+ * PUTs its handle (its offset, in HEAP_UNITs) as the key's value_type. GET
+ * hands the handle back, and the client reads the bytes where they are -
+ * they never go through the ring or get copied by the server.
+ * A blob is never written again once it is PUT. When a PUT replaces it, the
+ * server retires it, and puts it back on its size class' free list once
+ * no client thread can still be reading it (epoch-based reclamation): a
+ * client thread announces an epoch before sending a request that can hand
+ * it a blob, and keeps it announced until it is done with the blob, and a
+ * blob retired at epoch e is only freed once every announced epoch is
+ * past e.
+*/
+
+#define HEAP_MAGIC 0x7061656865756c76ull // "vlueheap"
+
+/* Blobs are aligned to (and handles count) units of this many bytes */
+#define HEAP_UNIT 64
+
+/* Size classes: blobs of 64 B, 128 B, ..., 64 KiB, header included */
+#define HEAP_CLASSES 11
+#define HEAP_MAX_VALUE ((HEAP_UNIT << (HEAP_CLASSES - 1)) - sizeof(struct blob))
+
+/* Client threads that can announce an epoch */
+#define HEAP_MAX_READERS 128
+
+#define HEAP_HEADER_SIZE (16 << 10)
+
+/* Blobs a server thread retires before trying to free them */
+#define HEAP_RETIRE_BATCH 64
+
+/**
+ * A value. next links free blobs of a class, and is garbage otherwise.
+*/
+struct blob {
+    uint32_t len; // Bytes of data
+    uint32_t cls; // Size class
+    uint32_t next; // Handle of the next free blob of the class
+    uint32_t pad;
+    char data[];
+};
+
+struct __attribute__((aligned(64))) heap_reader {
+    uint64_t epoch; // Oldest epoch the thread may still read blobs from, 0 if none
+};
+
+/**
+ * The start of the heap segment.
+*/
+struct __attribute__((aligned(64))) value_heap {
+    uint64_t magic;
+    uint64_t size; // Of the whole segment
+    uint64_t bump; // Offset of the first byte never handed out
+    uint32_t num_readers; // Client threads, readers[] in use
+    /* Free lists: handle of the first blob in the low half, a count of the
+     * pops in the high one so a pop racing with pop-push-pop fails its CAS */
+    uint64_t free_heads[HEAP_CLASSES];
+    uint64_t __attribute__((aligned(64))) global_epoch; // Starts at 1
+    struct heap_reader readers[HEAP_MAX_READERS];
+    /* Totals, for the report at the end */
+    uint64_t __attribute__((aligned(64))) retired;
+    uint64_t freed;
+};
+
+_Static_assert(sizeof(struct value_heap) <= HEAP_HEADER_SIZE, "value_heap doesn't fit its header");
+
+/**
+ * A server thread's retired blobs, and the epoch each was retired at.
+*/
+struct retire_list {
+    uint32_t *handles;
+    uint64_t *epochs;
+    int len, cap;
+};
+
+/**
+ * Lay a heap out over a zeroed segment of size bytes.
+*/
+void heap_init(struct value_heap *h, uint64_t size, uint32_t num_readers);
+
+static inline struct blob *heap_blob(struct value_heap *h, uint32_t handle) {
+    return (struct blob*) ((char*) h + (uint64_t) handle * HEAP_UNIT);
+}
+
+/**
+ * Allocate a blob for len bytes (its len is set).
+ * @return its handle, 0 if the heap is full or len is too large.
+*/
+uint32_t heap_alloc(struct value_heap *h, uint32_t len);
+
+/**
+ * Whether handle points at a blob of the heap - a server must not trust
+ * what the client sent it.
+*/
+bool heap_valid(struct value_heap *h, uint32_t handle);
+
+/**
+ * Announce that the calling client thread may read blobs from the current
+ * epoch on (if it doesn't have an older epoch announced) - call before
+ * sending a request that returns handles.
+ * @return the current epoch, the request's own: once older requests are
+ * done, heap_announce() the oldest of those still in flight.
+*/
+uint64_t heap_enter(struct value_heap *h, int reader);
+
+/**
+ * Announce epoch instead (0 if the thread no longer reads any blob) - it
+ * has to be older than those of the blobs the thread still reads.
+*/
+void heap_announce(struct value_heap *h, int reader, uint64_t epoch);
+
+/**
+ * Retire a blob that a PUT replaced: it is freed once no reader can still
+ * have it.
+*/
+void heap_retire(struct value_heap *h, struct retire_list *rl, uint32_t handle);
+
+void heap_print_stats(struct value_heap *h, FILE *f);
@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "wait.h"
+
+static enum wait_strategy strategy = WAIT_ADAPTIVE;
+
+/* Spin budget of the calling thread (WAIT_ADAPTIVE) */
+static __thread int budget = WAIT_SPIN_INIT;
+
+/* Spinning only helps if the thread we're waiting for can run at the same
+ * time - on a single CPU we'd just be burning its time slice */
+static int multi_cpu = -1;
+
+static bool have_multi_cpu() {
+    if (multi_cpu < 0)
+        multi_cpu = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    return multi_cpu;
+}
+
+int parse_wait_strategy(const char *name, enum wait_strategy *ws) {
+    if (strcmp(name, "spin") == 0)
+        *ws = WAIT_SPIN;
+    else if (strcmp(name, "adaptive") == 0)
+        *ws = WAIT_ADAPTIVE;
+    else if (strcmp(name, "block") == 0)
+        *ws = WAIT_BLOCK;
+    else
+        return -1;
+    return 0;
+}
+
+void set_wait_strategy(enum wait_strategy ws) {
+    strategy = ws;
+}
+
+bool spin_or_sleep(struct spinner *sp) {
+    switch (strategy) {
+    case WAIT_SPIN:
+        sp->spins++;
+        // Let whoever we're waiting for run if it has to share our CPU
+        if (have_multi_cpu())
+            cpu_relax();
+        else
+            sched_yield();
+        return false;
+
+    case WAIT_ADAPTIVE:
+        if (have_multi_cpu() && sp->spins < budget) {
+            sp->spins++;
+            cpu_relax();
+            return false;
+        }
+        sp->slept = true;
+        return true;
+
+    default:
+        sp->slept = true;
+        return true;
+    }
+}
+
+void spin_done(struct spinner *sp) {
+    if (strategy != WAIT_ADAPTIVE)
+        return;
+    // Sleeping anyway means the spinning was wasted, while a wait that
+    // needed most of the budget might have needed more
+    if (sp->slept) {
+        if (budget / 2 >= WAIT_SPIN_MIN)
+            budget /= 2;
+    }
+    else if (sp->spins > budget / 2 && budget * 2 <= WAIT_SPIN_MAX) {
+        budget *= 2;
+    }
+}
+
+/* No FUTEX_PRIVATE_FLAG - the waker may be another process */
+void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+void futex_wait_any(uint32_t **addrs, int n, uint32_t val) {
+    if (n <= 0)
+        return;
+#ifdef SYS_futex_waitv
+    struct futex_waitv waiters[FUTEX_WAIT_ANY_MAX];
+    if (n > FUTEX_WAIT_ANY_MAX)
+        n = FUTEX_WAIT_ANY_MAX;
+    memset(waiters, 0, n * sizeof(struct futex_waitv));
+    for (int i = 0; i < n; i++) {
+        waiters[i].uaddr = (uintptr_t) addrs[i];
+        waiters[i].val = val;
+        waiters[i].flags = FUTEX_32;
+    }
+    if (syscall(SYS_futex_waitv, waiters, n, 0, NULL, CLOCK_MONOTONIC) >= 0 || errno != ENOSYS)
+        return;
+#endif
+    futex_wait(addrs[0], val);
+}
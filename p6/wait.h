@@ -0,0 +1,65 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Adaptive spin budget bounds, in polls of the awaited word */
+#define WAIT_SPIN_MIN 16
+#define WAIT_SPIN_INIT 1024
+#define WAIT_SPIN_MAX 65536
+
+/* How a thread waits for something another thread or process will do */
+enum wait_strategy {
+  WAIT_SPIN = 0,  /* poll forever, never sleep */
+  WAIT_ADAPTIVE,  /* poll for a budget that adapts to how long waits take, then futex-sleep */
+  WAIT_BLOCK      /* futex-sleep right away */
+};
+
+/* One wait - start it zeroed */
+struct spinner {
+  int spins;
+  bool slept;
+};
+
+/*
+ * Look up a strategy by name ("spin", "adaptive" or "block")
+ * @return 0 on success, -1 if there is no such strategy
+*/
+int parse_wait_strategy(const char *name, enum wait_strategy *ws);
+
+/* Set the strategy of every thread of this process (default: WAIT_ADAPTIVE) */
+void set_wait_strategy(enum wait_strategy ws);
+
+/*
+ * Called each time a waiting thread finds the awaited condition still false
+ * @return false after spinning once - poll again, true if the thread
+ * should now go to sleep (e.g. futex_wait on the word it polls)
+*/
+bool spin_or_sleep(struct spinner *sp);
+
+/* Called once the awaited condition came true - adapts the spin budget of
+ * the calling thread to how the wait went */
+void spin_done(struct spinner *sp);
+
+/* Hint to the CPU that we're busy-waiting - inline, as it sits in the
+ * hottest spin loops */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Process-shared futex operations (the words live in MAP_SHARED memory) */
+void futex_wait(uint32_t *addr, uint32_t val);
+void futex_wake(uint32_t *addr, int n);
+
+/* Most words futex_wait_any() sleeps on */
+#define FUTEX_WAIT_ANY_MAX 128
+
+/*
+ * Sleep until any of n (at most FUTEX_WAIT_ANY_MAX) words is woken, or
+ * doesn't hold val to begin with - futex_waitv, or futex_wait on the first
+ * word on kernels without it
+*/
+void futex_wait_any(uint32_t **addrs, int n, uint32_t val);
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "wal.h"
+
+static inline uint32_t wal_check(key_type k, value_type v) {
+    return hash_murmur(k ^ hash_murmur(v)) ^ WAL_MAGIC;
+}
+
+int parse_wal_sync(const char *name, enum wal_sync *sync, int *interval_ms) {
+    if (strcmp(name, "always") == 0)
+        *sync = WAL_SYNC_ALWAYS;
+    else if (strcmp(name, "never") == 0)
+        *sync = WAL_SYNC_NEVER;
+    else {
+        char *end;
+        long ms = strtol(name, &end, 10);
+        if (*name == '\0' || *end != '\0' || ms < 1 || ms > 60000)
+            return -1;
+        *sync = WAL_SYNC_INTERVAL;
+        *interval_ms = ms;
+    }
+    return 0;
+}
+
+static int init_batch(struct wal_batch *b) {
+    b->num_recs = b->num_comps = 0;
+    b->cap_recs = b->cap_comps = WAL_BATCH_INIT;
+    b->recs = malloc(sizeof(struct wal_record) * b->cap_recs);
+    b->comps = malloc(sizeof(struct wal_completion) * b->cap_comps);
+    return b->recs == NULL || b->comps == NULL ? -1 : 0;
+}
+
+int wal_open(struct wal *w, const char *path, enum wal_sync sync, int interval_ms) {
+    w->fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (w->fd < 0) {
+        perror("open");
+        return -1;
+    }
+    w->sync = sync;
+    w->interval_ms = interval_ms;
+    w->filling = 0;
+    w->records = w->writes = w->syncs = 0;
+    w->end = 0;
+    w->failed = false;
+    for (int i = 0; i < WAL_STRIPES; i++)
+        pthread_mutex_init(&w->stripes[i], NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if (init_batch(&w->batches[0]) < 0 || init_batch(&w->batches[1]) < 0)
+        return -1;
+    return 0;
+}
+
+long wal_replay(struct wal *w, uint64_t from, void (*apply)(void *arg, key_type k, value_type v), void *arg) {
+    struct wal_record recs[WAL_BATCH_INIT];
+    long replayed = 0;
+    off_t good = 0; // End of the last good record
+    struct stat statbuf;
+    if (fstat(w->fd, &statbuf) == 0 && from <= (uint64_t) statbuf.st_size &&
+        from % sizeof(struct wal_record) == 0)
+        good = from;
+    while (true) {
+        ssize_t n = pread(w->fd, recs, sizeof(recs), good);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            return -1;
+        }
+        int full = n / sizeof(struct wal_record);
+        int i;
+        for (i = 0; i < full; i++) {
+            if (recs[i].check != wal_check(recs[i].k, recs[i].v))
+                break;
+            apply(arg, recs[i].k, recs[i].v);
+        }
+        replayed += i;
+        good += (off_t) i * sizeof(struct wal_record);
+        if (i < full || n < (ssize_t) sizeof(recs))
+            break; // Hit a bad record or the end of the file
+    }
+    // Drop whatever is past the last good record, and append from there
+    if (ftruncate(w->fd, good) < 0 || lseek(w->fd, good, SEEK_SET) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    w->end = good;
+    return replayed;
+}
+
+/**
+ * Write all of buf, retrying short writes.
+ * @return 0 on success, -1 on error.
+*/
+static int write_all(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return -1;
+        }
+        buf = (const char*) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Take the filling batch once it has something in it, and let the server
+ * threads fill the other one meanwhile. With WAL_SYNC_INTERVAL and unsynced
+ * writes, gives up at the next sync deadline.
+ * @return the batch to write, NULL if the sync deadline came first.
+*/
+static struct wal_batch *wal_take_batch(struct wal *w, bool dirty, uint64_t sync_at) {
+    pthread_mutex_lock(&w->lock);
+    struct wal_batch *b = &w->batches[w->filling];
+    while (b->num_recs == 0) {
+        if (w->sync == WAL_SYNC_INTERVAL && dirty) {
+            struct timespec deadline = {sync_at / 1000, (sync_at % 1000) * 1000000};
+            if (pthread_cond_timedwait(&w->wakeup, &w->lock, &deadline) == ETIMEDOUT &&
+                b->num_recs == 0) {
+                pthread_mutex_unlock(&w->lock);
+                return NULL;
+            }
+        }
+        else
+            pthread_cond_wait(&w->wakeup, &w->lock);
+    }
+    w->filling ^= 1;
+    pthread_mutex_unlock(&w->lock);
+    return b;
+}
+
+/**
+ * Give up on the log after a failed write or sync: cut off whatever the
+ * failed write left past the end, so the file ends on a record that was
+ * written as a whole.
+*/
+static void wal_fail(struct wal *w) {
+    fprintf(stderr, "wal: refusing every PUT from now on\n");
+    w->failed = true;
+    if (ftruncate(w->fd, w->end) < 0 || lseek(w->fd, w->end, SEEK_SET) < 0)
+        perror("ftruncate");
+}
+
+static void *wal_flusher(void *arg) {
+    struct wal *w = arg;
+    bool dirty = false; // Written, but not synced
+    uint64_t sync_at = 0; // WAL_SYNC_INTERVAL: when dirty writes have to be synced
+    while (true) {
+        struct wal_batch *b = wal_take_batch(w, dirty, sync_at);
+        bool ok = !w->failed;
+        size_t len = b != NULL ? sizeof(struct wal_record) * b->num_recs : 0;
+        if (b != NULL && ok) {
+            ok = write_all(w->fd, b->recs, len) == 0;
+            if (ok) {
+                w->records += b->num_recs;
+                w->writes++;
+                if (!dirty)
+                    sync_at = now_ms() + w->interval_ms;
+                dirty = true;
+            }
+        }
+        if (ok && dirty && (w->sync == WAL_SYNC_ALWAYS ||
+                            (w->sync == WAL_SYNC_INTERVAL && now_ms() >= sync_at))) {
+            if (fdatasync(w->fd) < 0) {
+                perror("fdatasync");
+                ok = false;
+            }
+            else {
+                w->syncs++;
+                dirty = false;
+            }
+        }
+        if (!ok && !w->failed)
+            wal_fail(w);
+        if (!ok)
+            dirty = false; // Nothing left worth syncing
+        if (b == NULL)
+            continue;
+        if (ok)
+            __atomic_add_fetch(&w->end, len, __ATOMIC_RELEASE);
+        // Only the flusher touches a batch once it's been taken. The PUTs of
+        // a batch that didn't make it to the log fail, even though the table
+        // already has them
+        for (int i = 0; i < b->num_comps; i++) {
+            if (!ok)
+                b->comps[i].bd.req_type = FAILED;
+            complete_request(b->comps[i].result, &b->comps[i].bd);
+        }
+        __atomic_add_fetch(&w->completed, b->num_comps, __ATOMIC_RELEASE);
+        b->num_recs = b->num_comps = 0;
+    }
+    return NULL;
+}
+
+int wal_start(struct wal *w) {
+    return pthread_create(&w->flusher, NULL, &wal_flusher, w) == 0 ? 0 : -1;
+}
+
+/* Make room for n more elements of size sz in an array of cap elements */
+static void *grow(void *array, int *cap, int need, size_t sz) {
+    if (need <= *cap)
+        return array;
+    int new_cap = *cap;
+    while (new_cap < need)
+        new_cap *= 2;
+    void *bigger = realloc(array, new_cap * sz);
+    if (bigger == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    *cap = new_cap;
+    return bigger;
+}
+
+uint64_t wal_lock_keys(struct wal *w, struct kv_pair *pairs, int n) {
+    uint64_t held = 0;
+    for (int i = 0; i < n; i++)
+        held |= 1ull << (hash_murmur(pairs[i].k) % WAL_STRIPES);
+    // In stripe order, so two MPUTs can't deadlock
+    for (uint64_t m = held; m != 0; m &= m - 1)
+        pthread_mutex_lock(&w->stripes[__builtin_ctzll(m)]);
+    return held;
+}
+
+void wal_unlock_keys(struct wal *w, uint64_t held) {
+    for (; held != 0; held &= held - 1)
+        pthread_mutex_unlock(&w->stripes[__builtin_ctzll(held)]);
+}
+
+void wal_append(struct wal *w, struct kv_pair *pairs, int n,
+                struct buffer_descriptor *result, struct buffer_descriptor *bd) {
+    if (n == 0) { // Nothing to wait for
+        complete_request(result, bd);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    struct wal_batch *b = &w->batches[w->filling];
+    b->recs = grow(b->recs, &b->cap_recs, b->num_recs + n, sizeof(struct wal_record));
+    b->comps = grow(b->comps, &b->cap_comps, b->num_comps + 1, sizeof(struct wal_completion));
+    bool was_empty = b->num_recs == 0;
+    for (int i = 0; i < n; i++) {
+        struct wal_record *rec = &b->recs[b->num_recs++];
+        rec->k = pairs[i].k;
+        rec->v = pairs[i].v;
+        rec->check = wal_check(rec->k, rec->v);
+    }
+    b->comps[b->num_comps].result = result;
+    b->comps[b->num_comps].bd = *bd;
+    b->num_comps++;
+    w->appended++;
+    pthread_mutex_unlock(&w->lock);
+    if (was_empty)
+        pthread_cond_signal(&w->wakeup);
+}
+
+uint64_t wal_position(struct wal *w) {
+    return __atomic_load_n(&w->end, __ATOMIC_ACQUIRE);
+}
+
+void wal_wait_completed(struct wal *w) {
+    pthread_mutex_lock(&w->lock);
+    uint64_t target = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    while (__atomic_load_n(&w->completed, __ATOMIC_ACQUIRE) < target)
+        usleep(1000);
+}
+
+void wal_print_stats(struct wal *w, FILE *f) {
+    fprintf(f, "wal: %lu records in %lu writes, %lu syncs%s\n",
+            w->records, w->writes, w->syncs, w->failed ? ", failed" : "");
+}
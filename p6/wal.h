@@ -0,0 +1,155 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/* Initial room of a batch, in records and in held completions */
+#define WAL_BATCH_INIT 1024
+
+/* Mixed into every record's check word, so an all-zero tail isn't valid */
+#define WAL_MAGIC 0x9e3779b9u
+
+/* Locks a key's table update and its log record are made under - one bit
+ * of a stripe mask each */
+#define WAL_STRIPES 64
+
+/**
+ * When the log is flushed to disk.
+*/
+enum wal_sync {
+    WAL_SYNC_ALWAYS = 0, // fdatasync every batch before completing its PUTs
+    WAL_SYNC_INTERVAL,   // fdatasync at most every interval_ms
+    WAL_SYNC_NEVER       // Leave it to the OS
+};
+
+/**
+ * One PUT, as stored in the log file.
+*/
+struct wal_record {
+    key_type k;
+    value_type v;
+    uint32_t check; // wal_check(k, v) - a torn or garbage record won't match
+};
+
+/**
+ * A PUT (or MPUT) whose completion is held back until its records are
+ * written.
+*/
+struct wal_completion {
+    struct buffer_descriptor *result;
+    struct buffer_descriptor bd;
+};
+
+/**
+ * Records appended since the last write, and the completions waiting for
+ * them.
+*/
+struct wal_batch {
+    struct wal_record *recs;
+    int num_recs, cap_recs;
+    struct wal_completion *comps;
+    int num_comps, cap_comps;
+};
+
+/**
+ * An append-only log of PUTs with group commit: server threads append to
+ * one batch while the flusher thread writes (and, depending on the sync
+ * policy, fdatasyncs) the other, so one write and one sync cover every PUT
+ * that arrived during the previous one.
+*/
+struct wal {
+    int fd;
+    enum wal_sync sync;
+    int interval_ms;
+    pthread_mutex_t stripes[WAL_STRIPES]; // See wal_lock_keys()
+    pthread_mutex_t lock; // Protects batches and filling
+    pthread_cond_t wakeup; // Signalled when the filling batch gets its first record
+    struct wal_batch batches[2];
+    int filling; // Batch the server threads append to
+    pthread_t flusher;
+    uint64_t end; // Size of the log file, as far as the flusher has written it
+                  // (and synced it, with WAL_SYNC_ALWAYS)
+    bool failed; // A write or sync failed - every PUT since completes as FAILED
+    uint64_t appended; // PUT requests handed to the log - protected by lock
+    uint64_t completed; // and those the flusher completed
+    uint64_t records; // Stats - only touched by the flusher
+    uint64_t writes;
+    uint64_t syncs;
+};
+
+/**
+ * Parse a sync policy: "always", "never", or a number of milliseconds
+ * between syncs.
+ * @return 0 on success, -1 if the policy isn't valid.
+*/
+int parse_wal_sync(const char *name, enum wal_sync *sync, int *interval_ms);
+
+/**
+ * Open (or create) the log file. Nothing is written until wal_start().
+ * @return 0 on success, -1 on error.
+*/
+int wal_open(struct wal *w, const char *path, enum wal_sync sync, int interval_ms);
+
+/**
+ * Call apply(arg, k, v) on every record of the log from byte offset from
+ * on, in order, stopping at the first torn or corrupt record - that record
+ * and anything after it are cut off, so new records go right after the last
+ * good one.
+ * @param from where to start (e.g. the log position a snapshot covers) -
+ * the whole log is replayed if it is shorter than that.
+ * @return the number of records replayed, -1 on error.
+*/
+long wal_replay(struct wal *w, uint64_t from, void (*apply)(void *arg, key_type k, value_type v), void *arg);
+
+/**
+ * Get the size of the log as written so far - every PUT logged before it
+ * has already been applied to the table.
+*/
+uint64_t wal_position(struct wal *w);
+
+/**
+ * Start the flusher thread.
+ * @return 0 on success, -1 on error.
+*/
+int wal_start(struct wal *w);
+
+/**
+ * Lock the stripes of n keys, in stripe order. Whoever updates a key in the
+ * table and logs it holds the key's stripe across both, so the log has each
+ * key's records in the order the table applied them - replaying it in file
+ * order leaves every key with the value it had.
+ * @return the stripes taken, for wal_unlock_keys().
+*/
+uint64_t wal_lock_keys(struct wal *w, struct kv_pair *pairs, int n);
+
+/**
+ * Unlock the stripes wal_lock_keys() took.
+*/
+void wal_unlock_keys(struct wal *w, uint64_t held);
+
+/**
+ * Log n key-value pairs that were just put, and hold the request's
+ * completion until they've been written (and synced, with WAL_SYNC_ALWAYS).
+ * If that fails, the request completes as FAILED, and so does every later
+ * one.
+ * Thread-safe, but the caller should hold the keys' stripes since before it
+ * put them.
+ * @param result where the client expects the result.
+ * @param bd the result, copied.
+*/
+void wal_append(struct wal *w, struct kv_pair *pairs, int n,
+                struct buffer_descriptor *result, struct buffer_descriptor *bd);
+
+/**
+ * Wait until every PUT logged so far has been completed - the flusher won't
+ * write to the completion boards they were meant for any more.
+*/
+void wal_wait_completed(struct wal *w);
+
+/**
+ * Print how many records, writes and syncs the log did.
+*/
+void wal_print_stats(struct wal *w, FILE *f);
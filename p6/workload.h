@@ -0,0 +1,63 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Binary workload format (written by gen_workload, mmapped by the client):
+ * a struct workload_header with WORKLOAD_MAGIC, then count struct requests.
+ * The matching solution file is a header with SOLUTION_MAGIC, then the
+ * count value_types the GET requests should return (for a SCAN, the
+ * scan_digest() of the pairs it should return, and for an ADD, CAS or SWAP,
+ * the value it should find), in order.
+ * Both use the byte order of the machine that wrote them.
+*/
+#define WORKLOAD_MAGIC "P6WKLD2"
+#define SOLUTION_MAGIC "P6SOLN1"
+
+struct workload_header {
+	char magic[8];
+	uint64_t count;
+};
+
+/* One request of a workload - t is an enum REQUEST_TYPE (PUT, GET, SCAN,
+ * ADD, CAS or SWAP; a SCAN asks for the first v pairs with keys >= k) */
+struct request {
+	key_type k;
+	value_type v;
+	uint32_t t;
+	value_type cmp; /* CAS only */
+};
+
+#define SCAN_DIGEST_SEED 0x5ca9u
+
+/* Fold the next pair a SCAN returned into the digest so far (start from
+ * SCAN_DIGEST_SEED) - order matters */
+static inline uint32_t scan_digest_add(uint32_t h, key_type k, value_type v) {
+	return hash_murmur(hash_murmur(h ^ k) ^ v);
+}
+
+static inline uint32_t scan_digest(const struct kv_pair *pairs, uint32_t n) {
+	uint32_t h = SCAN_DIGEST_SEED;
+	for (uint32_t i = 0; i < n; i++)
+		h = scan_digest_add(h, pairs[i].k, pairs[i].v);
+	return h;
+}
+
+/*
+ * Zipf sample with parameter a > 1 (same distribution as numpy's zipf)
+ * @param rand01 source of uniform doubles in (0, 1]
+*/
+static inline key_type zipf_sample(double a, double (*rand01)(void)) {
+	double am1 = a - 1.0;
+	double b = pow(2.0, am1);
+	while (1) {
+		double u = rand01(), v = rand01();
+		double x = floor(pow(u, -1.0 / am1));
+		if (x < 1.0 || x > 4e9)
+			continue;
+		double t = pow(1.0 + 1.0 / x, am1);
+		if (v * x * (t - 1.0) / (b - 1.0) <= t / b)
+			return (key_type) x;
+	}
+}